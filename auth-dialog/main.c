@@ -31,9 +31,6 @@
 #define _GNU_SOURCE
 #include <getopt.h>
 
-#include <libxml/parser.h>
-#include <libxml/tree.h>
-
 #include <gtk/gtk.h>
 #include <glib-unix.h>
 
@@ -41,6 +38,8 @@
 
 #include "openconnect.h"
 
+#include "xmlconfig.h"
+
 #if !OPENCONNECT_CHECK_VER(2,1)
 #define __openconnect_set_token_mode(...) -EOPNOTSUPP
 #elif !OPENCONNECT_CHECK_VER(2,2)
@@ -97,13 +96,6 @@ static const SecretSchema openconnect_secret_schema = {
 
 static char *lasthost;
 
-typedef struct vpnhost {
-	char *hostname;
-	char *hostaddress;
-	char *usergroup;
-	struct vpnhost *next;
-} vpnhost;
-
 vpnhost *vpnhosts;
 
 enum certificate_response{
@@ -198,6 +190,10 @@ typedef struct auth_ui_data {
 
 	int autosubmit;
 	int fields_pending;
+
+	gboolean headless; /* no GTK; forms are answered from stored secrets */
+	char *headless_form; /* auth_id of the form answered last */
+	int headless_repeats;
 } auth_ui_data;
 
 enum {
@@ -211,6 +207,7 @@ enum {
 static auth_ui_data *_ui_data;
 
 static void connect_host(auth_ui_data *ui_data);
+static void queue_connect_host(auth_ui_data *ui_data);
 
 static void container_child_remove(GtkWidget *widget, gpointer data)
 {
@@ -627,6 +624,77 @@ static gboolean set_initial_authgroup (auth_ui_data *ui_data, struct oc_auth_for
 	return FALSE;
 }
 
+/* Answers a form without asking anybody: text and select options from
+   the saved form answers, passwords from the secret store. Token fields
+   are filled in by openconnect itself. */
+static int headless_process_form (auth_ui_data *ui_data, struct oc_auth_form *form)
+{
+	struct oc_form_opt *opt;
+
+	/* A login can take any number of different forms, but the same form
+	   coming back over and over means the stored answers are wrong. */
+	if (g_strcmp0(ui_data->headless_form, form->auth_id)) {
+		g_free(ui_data->headless_form);
+		ui_data->headless_form = g_strdup(form->auth_id);
+		ui_data->headless_repeats = 0;
+	} else if (++ui_data->headless_repeats >= AUTOSUBMIT_LIMIT) {
+		fprintf(stderr, "Giving up on form '%s'\n", form->auth_id);
+		return OC_FORM_RESULT_CANCELLED;
+	}
+
+	if (form->message)
+		fprintf(stderr, "%s\n", form->message);
+	if (form->error)
+		fprintf(stderr, "%s\n", form->error);
+
+	for (opt = form->opts; opt; opt = opt->next) {
+		char *value = NULL;
+
+		if (opt->type == OC_FORM_OPT_HIDDEN ||
+		    IGNORE_OPT(opt))
+			continue;
+
+		if (opt->type == OC_FORM_OPT_TEXT) {
+			value = g_strdup (find_form_answer(ui_data->secrets, form, opt));
+			if (!value)
+				value = dup_option_value(opt);
+		} else if (opt->type == OC_FORM_OPT_SELECT) {
+			value = g_strdup (find_form_answer(ui_data->secrets, form, opt));
+			if (!value && opt == AUTHGROUP_OPT(form)) {
+				struct oc_form_opt_select *sopt = (void *)opt;
+				value = g_strdup (FORMCHOICE(sopt, AUTHGROUP_SELECTION(form))->name);
+			}
+		} else if (opt->type == OC_FORM_OPT_PASSWORD) {
+			char *password;
+
+			password = secret_password_lookup_sync (&openconnect_secret_schema, NULL, NULL,
+			                                        "vpn_uuid", ui_data->vpn_uuid,
+			                                        "auth_id", form->auth_id,
+			                                        "label", opt->name,
+			                                        NULL);
+			value = g_strdup (password);
+			secret_password_free (password);
+		} else
+			continue;
+
+		if (!value) {
+			fprintf(stderr, "No stored answer for '%s' in form '%s'\n",
+				opt->name, form->auth_id);
+			return OC_FORM_RESULT_CANCELLED;
+		}
+
+		openconnect_set_option_value(opt, value);
+		if (opt->type != OC_FORM_OPT_PASSWORD)
+			g_hash_table_insert (ui_data->success_secrets,
+					     g_strdup_printf("form:%s:%s", form->auth_id, opt->name),
+					     g_strdup (value));
+		memset(value, 0, strlen(value));
+		g_free(value);
+	}
+
+	return OC_FORM_RESULT_OK;
+}
+
 static int nm_process_auth_form (void *cbdata, struct oc_auth_form *form)
 {
 	auth_ui_data *ui_data = cbdata;
@@ -635,6 +703,9 @@ static int nm_process_auth_form (void *cbdata, struct oc_auth_form *form)
 	if (set_initial_authgroup(ui_data, form))
 		return OC_FORM_RESULT_NEWGROUP;
 
+	if (ui_data->headless)
+		return headless_process_form(ui_data, form);
+
 	ui_data->newgroup = FALSE;
 	g_idle_add((GSourceFunc)ui_form, form);
 
@@ -824,6 +895,14 @@ static int validate_peer_cert(void *cbdata,
 	if (accepted_hash && !openconnect_check_peer_cert_hash(ui_data->vpninfo, accepted_hash))
 		goto accepted;
 
+	/* Nobody to ask; only a certificate accepted before will do */
+	if (ui_data->headless) {
+		fprintf(stderr, "Certificate from VPN server '%s' failed verification: %s\n",
+			openconnect_get_hostname(ui_data->vpninfo), reason);
+		g_free (certkey);
+		return -EINVAL;
+	}
+
 	ui_data->autosubmit = 0;
 
 	data = g_slice_new(cert_data);
@@ -881,10 +960,9 @@ static gboolean get_save_passwords(GHashTable *secrets)
 	return FALSE;
 }
 
-static int parse_xmlconfig(gchar *xmlconfig)
+/* Appends @hosts to the configured gateway */
+static void merge_vpnhosts(vpnhost *hosts)
 {
-	xmlDocPtr xml_doc;
-	xmlNode *xml_node, *xml_node2;
 	struct vpnhost *newhost, **list_end;
 
 	list_end = &vpnhosts->next;
@@ -892,64 +970,121 @@ static int parse_xmlconfig(gchar *xmlconfig)
 	while (*list_end) {
 		list_end = &(*list_end)->next;
 	}
-
-	xml_doc = xmlReadMemory(xmlconfig, strlen(xmlconfig), "noname.xml", NULL, 0);
-
-	xml_node = xmlDocGetRootElement(xml_doc);
-	for (xml_node = xml_node->children; xml_node; xml_node = xml_node->next) {
-                if (xml_node->type == XML_ELEMENT_NODE &&
-                    !strcmp((char *)xml_node->name, "ServerList")) {
-
-                        for (xml_node = xml_node->children; xml_node;
-                             xml_node = xml_node->next) {
-
-                                if (xml_node->type == XML_ELEMENT_NODE &&
-                                    !strcmp((char *)xml_node->name, "HostEntry")) {
-                                        int match = 0;
-
-					newhost = malloc(sizeof(*newhost));
-					if (!newhost)
-						return -ENOMEM;
-
-					memset(newhost, 0, sizeof(*newhost));
-                                        for (xml_node2 = xml_node->children;
-                                             match >= 0 && xml_node2; xml_node2 = xml_node2->next) {
-
-                                                if (xml_node2->type != XML_ELEMENT_NODE)
-                                                        continue;
-
-                                                if (!strcmp((char *)xml_node2->name, "HostName")) {
-                                                        char *content = (char *)xmlNodeGetContent(xml_node2);
-							newhost->hostname = content;
-						} else if (!strcmp((char *)xml_node2->name, "HostAddress")) {
-                                                        char *content = (char *)xmlNodeGetContent(xml_node2);
-							newhost->hostaddress = content;
-						} else if (!strcmp((char *)xml_node2->name, "UserGroup")) {
-                                                        char *content = (char *)xmlNodeGetContent(xml_node2);
-							newhost->usergroup = content;
-						}
-					}
-					if (newhost->hostname && newhost->hostaddress) {
-						*list_end = newhost;
-						list_end = &newhost->next;
-
-						if (!strcasecmp(newhost->hostaddress, vpnhosts->hostaddress) &&
-						    !strcasecmp(newhost->usergroup ?: "", vpnhosts->usergroup ?: "")) {
-							/* Remove originally configured host if it's in the list */
-							struct vpnhost *tmp = vpnhosts->next;
-							free(vpnhosts);
-							vpnhosts = tmp;
-						}
-
-                                        } else
-						free(newhost);
-                                }
-                        }
+	*list_end = hosts;
+
+	for (newhost = hosts; newhost; newhost = newhost->next) {
+		if (!strcasecmp(newhost->hostaddress, vpnhosts->hostaddress) &&
+		    !strcasecmp(newhost->usergroup ?: "", vpnhosts->usergroup ?: "")) {
+			/* Remove originally configured host if it's in the list */
+			struct vpnhost *tmp = vpnhosts->next;
+			free(vpnhosts);
+			vpnhosts = tmp;
 			break;
-                }
-        }
-        xmlFreeDoc(xml_doc);
-	return 0;
+		}
+	}
+}
+
+/* The parsed server list is cached per connection, along with the SHA1
+   of the profile it came from, so that an unchanged profile needn't be
+   parsed again. The file holds the header line and then, for each host,
+   a byte telling whether there is a user group followed by the host
+   name, address and user group as NUL terminated strings. */
+
+#define HOST_CACHE_MAGIC "NMOC-HOSTS-1 "
+
+static char *host_cache_path(const char *vpn_uuid)
+{
+	char *name, *path;
+
+	name = g_strdup_printf("hosts-%s", vpn_uuid);
+	path = g_build_filename(g_get_user_cache_dir(), "networkmanager-openconnect",
+				name, NULL);
+	g_free(name);
+	return path;
+}
+
+/* Returns %FALSE if there is no valid cache for @sha1 */
+static gboolean host_cache_load(const char *vpn_uuid, const char *sha1, vpnhost **out_hosts)
+{
+	struct vpnhost *hosts = NULL, *newhost, **list_end = &hosts;
+	char *path = host_cache_path(vpn_uuid);
+	char *contents, *p, *end;
+	char *strings[3];
+	gsize len;
+	int i, n;
+
+	if (!g_file_get_contents(path, &contents, &len, NULL)) {
+		g_free(path);
+		return FALSE;
+	}
+	g_free(path);
+
+	p = contents;
+	end = contents + len;
+	if (len < strlen(HOST_CACHE_MAGIC) + strlen(sha1) + 1 ||
+	    memcmp(p, HOST_CACHE_MAGIC, strlen(HOST_CACHE_MAGIC)) ||
+	    memcmp(p + strlen(HOST_CACHE_MAGIC), sha1, strlen(sha1)) ||
+	    p[strlen(HOST_CACHE_MAGIC) + strlen(sha1)] != '\n')
+		goto invalid;
+	p += strlen(HOST_CACHE_MAGIC) + strlen(sha1) + 1;
+
+	while (p < end) {
+		n = *p++ ? 3 : 2;
+		for (i = 0; i < n; i++) {
+			char *nul = memchr(p, 0, end - p);
+			if (!nul)
+				goto invalid;
+			strings[i] = p;
+			p = nul + 1;
+		}
+
+		newhost = malloc(sizeof(*newhost));
+		if (!newhost)
+			goto invalid;
+		memset(newhost, 0, sizeof(*newhost));
+		newhost->hostname = g_strdup(strings[0]);
+		newhost->hostaddress = g_strdup(strings[1]);
+		if (n == 3)
+			newhost->usergroup = g_strdup(strings[2]);
+		*list_end = newhost;
+		list_end = &newhost->next;
+	}
+
+	g_free(contents);
+	*out_hosts = hosts;
+	return TRUE;
+
+ invalid:
+	free_vpnhosts(hosts);
+	g_free(contents);
+	return FALSE;
+}
+
+static void host_cache_store(const char *vpn_uuid, const char *sha1, vpnhost *hosts)
+{
+	char *path = host_cache_path(vpn_uuid);
+	char *dir = g_path_get_dirname(path);
+	GString *data;
+	vpnhost *host;
+
+	data = g_string_new(HOST_CACHE_MAGIC);
+	g_string_append(data, sha1);
+	g_string_append_c(data, '\n');
+	for (host = hosts; host; host = host->next) {
+		g_string_append_c(data, host->usergroup ? 1 : 0);
+		g_string_append_len(data, host->hostname, strlen(host->hostname) + 1);
+		g_string_append_len(data, host->hostaddress, strlen(host->hostaddress) + 1);
+		if (host->usergroup)
+			g_string_append_len(data, host->usergroup, strlen(host->usergroup) + 1);
+	}
+
+	if (g_mkdir_with_parents(dir, 0700) < 0 ||
+	    !g_file_set_contents(path, data->str, data->len, NULL))
+		fprintf(stderr, "Failed to write %s\n", path);
+
+	g_string_free(data, TRUE);
+	g_free(dir);
+	g_free(path);
 }
 
 static int get_config (auth_ui_data *ui_data,
@@ -968,6 +1103,7 @@ static int get_config (auth_ui_data *ui_data,
 	char *token_mode;
 	char *token_secret;
 	char *protocol;
+	vpnhost *hosts;
 
 	hostname = g_hash_table_lookup (options, NM_OPENCONNECT_KEY_GATEWAY);
 	if (!hostname) {
@@ -1005,9 +1141,15 @@ static int get_config (auth_ui_data *ui_data,
 		sha1_text = g_checksum_get_string(sha1);
 
 		openconnect_set_xmlsha1 (vpninfo, (char *)sha1_text, strlen(sha1_text) + 1);
+
+		if (!host_cache_load (ui_data->vpn_uuid, sha1_text, &hosts)) {
+			hosts = parse_xmlconfig (config_str, config_len);
+			host_cache_store (ui_data->vpn_uuid, sha1_text, hosts);
+		}
+		merge_vpnhosts (hosts);
+
 		g_checksum_free(sha1);
-		
-		parse_xmlconfig (config_str);
+		g_free(config_str);
 	}
 
 	protocol = g_hash_table_lookup (options, NM_OPENCONNECT_KEY_PROTOCOL);
@@ -1081,6 +1223,301 @@ static int get_config (auth_ui_data *ui_data,
 	return 0;
 }
 
+/* Optionally probe all gateways of the server list in parallel, and
+   preselect the one which completes a TLS handshake first. The winner
+   is remembered per connection and server list for a while, so the
+   probes needn't run every time. The dialog doesn't wait for them: the
+   winner is moved to the top of the list when they are done. Only the
+   headless path, which has to pick a host up front, waits. Nothing is
+   probed through a proxy, as the probes would go around it. */
+
+#define PROBE_TIMEOUT_MS	1500
+#define PROBE_CACHE_TTL		(10 * 60)
+
+static char *fastest_host;
+
+struct probe_run;
+
+typedef struct gateway_probe {
+	vpnhost *host;
+	gint64 start;
+	gint64 rtt; /* -1 if unreachable */
+	struct probe_run *run;
+} gateway_probe;
+
+typedef struct probe_run {
+	auth_ui_data *ui_data;
+	char *hosts_hash;
+	gateway_probe *probes;
+	int n;
+	int pending;
+	GSocketClient *client;
+	GCancellable *cancellable;
+	GSource *deadline;
+	gboolean *done;
+} probe_run;
+
+static char *probe_cache_path(void)
+{
+	return g_build_filename(g_get_user_cache_dir(), "networkmanager-openconnect",
+				"gateway-probes", NULL);
+}
+
+/* A result only holds for the server list it was taken from */
+static char *probe_hosts_hash(void)
+{
+	GString *str = g_string_new(NULL);
+	vpnhost *host;
+	char *hash;
+
+	for (host = vpnhosts; host; host = host->next)
+		g_string_append_printf(str, "%s\n%s\n", host->hostname, host->hostaddress);
+	hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, str->str, str->len);
+	g_string_free(str, TRUE);
+	return hash;
+}
+
+static char *probe_cache_lookup(const char *vpn_uuid, const char *hosts_hash)
+{
+	GKeyFile *keyfile = g_key_file_new();
+	char *path = probe_cache_path();
+	char *host = NULL;
+	char *hash;
+	gint64 when;
+
+	if (g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, NULL)) {
+		when = g_key_file_get_int64(keyfile, vpn_uuid, "time", NULL);
+		hash = g_key_file_get_string(keyfile, vpn_uuid, "hosts", NULL);
+		if (when <= time(NULL) && time(NULL) - when < PROBE_CACHE_TTL &&
+		    hash && !strcmp(hash, hosts_hash))
+			host = g_key_file_get_string(keyfile, vpn_uuid, "host", NULL);
+		g_free(hash);
+	}
+
+	g_key_file_free(keyfile);
+	g_free(path);
+	return host;
+}
+
+static void probe_cache_store(const char *vpn_uuid, const char *hosts_hash,
+			      const char *host, gint64 rtt)
+{
+	GKeyFile *keyfile = g_key_file_new();
+	char *path = probe_cache_path();
+	char *dir, *data;
+	gsize len;
+
+	g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, NULL);
+	g_key_file_set_string(keyfile, vpn_uuid, "host", host);
+	g_key_file_set_string(keyfile, vpn_uuid, "hosts", hosts_hash);
+	g_key_file_set_int64(keyfile, vpn_uuid, "rtt", rtt);
+	g_key_file_set_int64(keyfile, vpn_uuid, "time", time(NULL));
+
+	dir = g_path_get_dirname(path);
+	data = g_key_file_to_data(keyfile, &len, NULL);
+	if (g_mkdir_with_parents(dir, 0700) < 0 ||
+	    !g_file_set_contents(path, data, len, NULL))
+		fprintf(stderr, "Failed to write %s\n", path);
+
+	g_free(data);
+	g_free(dir);
+	g_key_file_free(keyfile);
+	g_free(path);
+}
+
+/* HostAddress may be a bare host, host:port, or carry a path or scheme */
+static GSocketConnectable *probe_connectable(const char *address)
+{
+	GSocketConnectable *connectable;
+	char *hostport;
+
+	if (strstr(address, "://"))
+		return g_network_address_parse_uri(address, 443, NULL);
+
+	hostport = g_strndup(address, strcspn(address, "/"));
+	connectable = g_network_address_parse(hostport, 443, NULL);
+	g_free(hostport);
+	return connectable;
+}
+
+/* Moves @best to the top of the list. Unless a host is being connected
+   to already, it gets selected too. */
+static void probe_reorder_hosts(auth_ui_data *ui_data, vpnhost *best)
+{
+	GtkComboBoxText *combo;
+	vpnhost **p, *host, *active = best;
+	int i;
+
+	if (ui_data->combo && ui_data->getting_cookie) {
+		i = gtk_combo_box_get_active(GTK_COMBO_BOX(ui_data->combo));
+		for (active = vpnhosts; active && i > 0; i--)
+			active = active->next;
+	}
+
+	for (p = &vpnhosts; *p != best; p = &(*p)->next)
+		;
+	*p = best->next;
+	best->next = vpnhosts;
+	vpnhosts = best;
+
+	if (!ui_data->combo)
+		return;
+
+	/* The combo follows the order of vpnhosts */
+	combo = GTK_COMBO_BOX_TEXT(ui_data->combo);
+	g_signal_handlers_block_by_func(combo, queue_connect_host, ui_data);
+	gtk_combo_box_text_remove_all(combo);
+	for (host = vpnhosts, i = 0; host; host = host->next, i++) {
+		gtk_combo_box_text_append_text(combo, host->hostname);
+		if (host == active)
+			gtk_combo_box_set_active(GTK_COMBO_BOX(combo), i);
+	}
+	g_signal_handlers_unblock_by_func(combo, queue_connect_host, ui_data);
+}
+
+static void probe_run_finish(probe_run *run)
+{
+	gateway_probe *best = NULL;
+	int i;
+
+	g_source_destroy(run->deadline);
+	g_source_unref(run->deadline);
+
+	for (i = 0; i < run->n; i++) {
+		if (run->probes[i].rtt >= 0 && (!best || run->probes[i].rtt < best->rtt))
+			best = &run->probes[i];
+	}
+	if (best) {
+		g_free(fastest_host);
+		fastest_host = g_strdup(best->host->hostname);
+		probe_cache_store(run->ui_data->vpn_uuid, run->hosts_hash,
+				  fastest_host, best->rtt);
+		probe_reorder_hosts(run->ui_data, best->host);
+	}
+
+	if (run->done)
+		*run->done = TRUE;
+
+	g_object_unref(run->client);
+	g_object_unref(run->cancellable);
+	g_free(run->probes);
+	g_free(run->hosts_hash);
+	g_free(run);
+}
+
+static void probe_done(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	gateway_probe *probe = user_data;
+	GSocketConnection *conn;
+
+	conn = g_socket_client_connect_finish(G_SOCKET_CLIENT(source), result, NULL);
+	if (conn) {
+		probe->rtt = g_get_monotonic_time() - probe->start;
+		g_object_unref(conn);
+	}
+	if (!--probe->run->pending)
+		probe_run_finish(probe->run);
+}
+
+static gboolean probe_deadline(gpointer user_data)
+{
+	g_cancellable_cancel(user_data);
+	return FALSE;
+}
+
+/* Starts the probes on the thread-default main context */
+static void probe_run_start(probe_run *run)
+{
+	vpnhost *host;
+	int i;
+
+	for (host = vpnhosts; host; host = host->next)
+		run->n++;
+	run->probes = g_new0(gateway_probe, run->n);
+
+	run->cancellable = g_cancellable_new();
+	run->client = g_socket_client_new();
+	if (g_tls_backend_supports_tls(g_tls_backend_get_default())) {
+		/* Only the handshake is timed; nothing is sent */
+		g_socket_client_set_tls(run->client, TRUE);
+		g_socket_client_set_tls_validation_flags(run->client, 0);
+	}
+
+	for (host = vpnhosts, i = 0; host; host = host->next, i++) {
+		GSocketConnectable *connectable;
+
+		run->probes[i].host = host;
+		run->probes[i].rtt = -1;
+		run->probes[i].run = run;
+
+		connectable = probe_connectable(host->hostaddress);
+		if (!connectable)
+			continue;
+
+		run->probes[i].start = g_get_monotonic_time();
+		run->pending++;
+		g_socket_client_connect_async(run->client, connectable, run->cancellable,
+					      probe_done, &run->probes[i]);
+		g_object_unref(connectable);
+	}
+
+	run->deadline = g_timeout_source_new(PROBE_TIMEOUT_MS);
+	g_source_set_callback(run->deadline, probe_deadline, run->cancellable, NULL);
+	g_source_attach(run->deadline, g_main_context_get_thread_default());
+
+	if (!run->pending)
+		probe_run_finish(run);
+}
+
+static void probe_gateways(auth_ui_data *ui_data)
+{
+	GMainContext *context;
+	const char *proxy;
+	probe_run *run;
+	gboolean done = FALSE;
+
+	if (!vpnhosts->next)
+		return;
+
+	proxy = g_hash_table_lookup(ui_data->options, NM_OPENCONNECT_KEY_PROXY);
+	if (proxy && proxy[0])
+		return;
+
+	run = g_new0(probe_run, 1);
+	run->ui_data = ui_data;
+	run->hosts_hash = probe_hosts_hash();
+
+	fastest_host = probe_cache_lookup(ui_data->vpn_uuid, run->hosts_hash);
+	if (fastest_host) {
+		g_free(run->hosts_hash);
+		g_free(run);
+		return;
+	}
+
+	/* The dialog picks the result up from its main loop */
+	if (!ui_data->headless) {
+		probe_run_start(run);
+		return;
+	}
+
+	context = g_main_context_new();
+	g_main_context_push_thread_default(context);
+
+	run->done = &done;
+	probe_run_start(run);
+	while (!done)
+		g_main_context_iteration(context, TRUE);
+
+	g_main_context_pop_thread_default(context);
+	g_main_context_unref(context);
+}
+
+/* The host to select initially */
+static const char *initial_host(void)
+{
+	return fastest_host ?: lasthost;
+}
+
 static void populate_vpnhost_combo(auth_ui_data *ui_data)
 {
 	struct vpnhost *host;
@@ -1091,7 +1528,7 @@ static void populate_vpnhost_combo(auth_ui_data *ui_data)
 		gtk_combo_box_text_append_text(combo, host->hostname);
 
 		if (i == 0 ||
-		    (lasthost && !strcmp(host->hostname, lasthost)))
+		    (initial_host() && !strcmp(host->hostname, initial_host())))
 			gtk_combo_box_set_active(GTK_COMBO_BOX (combo), i);
 		i++;
 
@@ -1190,6 +1627,7 @@ static gboolean write_notice_real(char *message)
  _nm_printf (3, 4)
 static void write_progress(void *cbdata, int level, const char *fmt, ...)
 {
+	auth_ui_data *ui_data = cbdata;
 	va_list args;
 	char *msg;
 
@@ -1197,6 +1635,13 @@ static void write_progress(void *cbdata, int level, const char *fmt, ...)
 	msg = g_strdup_vprintf(fmt, args);
 	va_end(args);
 
+	if (ui_data->headless) {
+		if (level <= PRG_ERR)
+			fputs(msg, stderr);
+		g_free(msg);
+		return;
+	}
+
 	if (level <= PRG_ERR) {
 		g_idle_add((GSourceFunc)write_notice_real, g_strdup(msg));
 	}
@@ -1218,6 +1663,47 @@ static void hash_table_merge (GHashTable *old_hash, GHashTable *new_hash)
 	g_hash_table_foreach_steal (old_hash, &hash_merge_one, new_hash);
 }
 
+/* Called once the cookie has been obtained */
+static void cookie_collect_secrets(auth_ui_data *ui_data)
+{
+	const void *cert;
+	gchar *key, *value;
+
+	/* Merge in the secrets which we only wanted to remember if
+	   the connection was successful (lasthost, form entries) */
+	hash_table_merge (ui_data->success_secrets, ui_data->secrets);
+
+	/* Merge in the three *real* secrets that are actually used
+	   by nm-openconnect-service to make the connection */
+	key = g_strdup (NM_OPENCONNECT_KEY_GATEWAY);
+	value = g_strdup_printf ("%s:%d",
+				 openconnect_get_hostname(ui_data->vpninfo),
+				 openconnect_get_port(ui_data->vpninfo));
+	g_hash_table_insert (ui_data->secrets, key, value);
+
+	key = g_strdup (NM_OPENCONNECT_KEY_COOKIE);
+	value = g_strdup (openconnect_get_cookie (ui_data->vpninfo));
+	g_hash_table_insert (ui_data->secrets, key, value);
+	openconnect_clear_cookie(ui_data->vpninfo);
+
+#if OPENCONNECT_CHECK_VER(5,0)
+	cert = openconnect_get_peer_cert_hash (ui_data->vpninfo);
+	if (cert) {
+		key = g_strdup (NM_OPENCONNECT_KEY_GWCERT);
+		value = g_strdup (cert);
+		g_hash_table_insert (ui_data->secrets, key, value);
+	}
+#else
+	cert = openconnect_get_peer_cert (ui_data->vpninfo);
+	if (cert) {
+		key = g_strdup (NM_OPENCONNECT_KEY_GWCERT);
+		value = g_malloc0 (41);
+		openconnect_get_cert_sha1(ui_data->vpninfo, (void *)cert, value);
+		g_hash_table_insert (ui_data->secrets, key, value);
+	}
+#endif
+}
+
 static gboolean cookie_obtained(auth_ui_data *ui_data)
 {
 	ui_data->getting_cookie = FALSE;
@@ -1243,44 +1729,9 @@ static gboolean cookie_obtained(auth_ui_data *ui_data)
 			gtk_widget_set_sensitive(ui_data->cancel_button, FALSE);
 		}
 	} else if (!ui_data->cookie_retval) {
-		const void *cert;
-		gchar *key, *value;
-
 		/* got cookie */
+		cookie_collect_secrets(ui_data);
 
-		/* Merge in the secrets which we only wanted to remember if
-		   the connection was successful (lasthost, form entries) */
-		hash_table_merge (ui_data->success_secrets, ui_data->secrets);
-
-		/* Merge in the three *real* secrets that are actually used
-		   by nm-openconnect-service to make the connection */
-		key = g_strdup (NM_OPENCONNECT_KEY_GATEWAY);
-		value = g_strdup_printf ("%s:%d",
-					 openconnect_get_hostname(ui_data->vpninfo),
-					 openconnect_get_port(ui_data->vpninfo));
-		g_hash_table_insert (ui_data->secrets, key, value);
-
-		key = g_strdup (NM_OPENCONNECT_KEY_COOKIE);
-		value = g_strdup (openconnect_get_cookie (ui_data->vpninfo));
-		g_hash_table_insert (ui_data->secrets, key, value);
-		openconnect_clear_cookie(ui_data->vpninfo);
-
-#if OPENCONNECT_CHECK_VER(5,0)
-		cert = openconnect_get_peer_cert_hash (ui_data->vpninfo);
-		if (cert) {
-			key = g_strdup (NM_OPENCONNECT_KEY_GWCERT);
-			value = g_strdup (cert);
-			g_hash_table_insert (ui_data->secrets, key, value);
-		}
-#else
-		cert = openconnect_get_peer_cert (ui_data->vpninfo);
-		if (cert) {
-			key = g_strdup (NM_OPENCONNECT_KEY_GWCERT);
-			value = g_malloc0 (41);
-			openconnect_get_cert_sha1(ui_data->vpninfo, (void *)cert, value);
-			g_hash_table_insert (ui_data->secrets, key, value);
-		}
-#endif
 		if (get_save_passwords(ui_data->secrets)) {
 			g_hash_table_foreach(ui_data->success_passwords,
 					     keyring_store_passwords,
@@ -1315,6 +1766,26 @@ static gpointer obtain_cookie (auth_ui_data *ui_data)
 	return NULL;
 }
 
+static void prepare_host(auth_ui_data *ui_data, vpnhost *host)
+{
+	/* reset ssl context.
+	 * TODO: this is probably not the way to go... */
+	openconnect_reset_ssl(ui_data->vpninfo);
+
+	if (openconnect_parse_url(ui_data->vpninfo, host->hostaddress)) {
+		fprintf(stderr, "Failed to parse server URL '%s'\n",
+			host->hostaddress);
+		openconnect_set_hostname (ui_data->vpninfo, OC3DUP (host->hostaddress));
+	}
+
+	if (!openconnect_get_urlpath(ui_data->vpninfo) && host->usergroup)
+		openconnect_set_urlpath(ui_data->vpninfo, OC3DUP (host->usergroup));
+
+
+	g_hash_table_insert (ui_data->success_secrets, g_strdup("lasthost"),
+			     g_strdup(host->hostname));
+}
+
 static void connect_host(auth_ui_data *ui_data)
 {
 	GThread *thread;
@@ -1335,27 +1806,13 @@ static void connect_host(auth_ui_data *ui_data)
 	gtk_widget_set_sensitive (ui_data->cancel_button, TRUE);
 	while (read(ui_data->cancel_pipes[0], &cancelbuf, 1) == 1)
 		;
-	/* reset ssl context.
-	 * TODO: this is probably not the way to go... */
-	openconnect_reset_ssl(ui_data->vpninfo);
 
 	host_nr = gtk_combo_box_get_active(GTK_COMBO_BOX(ui_data->combo));
 	host = vpnhosts;
 	for (i = 0; i < host_nr; i++)
 		host = host->next;
 
-	if (openconnect_parse_url(ui_data->vpninfo, host->hostaddress)) {
-		fprintf(stderr, "Failed to parse server URL '%s'\n",
-			host->hostaddress);
-		openconnect_set_hostname (ui_data->vpninfo, OC3DUP (host->hostaddress));
-	}
-
-	if (!openconnect_get_urlpath(ui_data->vpninfo) && host->usergroup)
-		openconnect_set_urlpath(ui_data->vpninfo, OC3DUP (host->usergroup));
-
-
-	g_hash_table_insert (ui_data->success_secrets, g_strdup("lasthost"),
-			     g_strdup(host->hostname));
+	prepare_host(ui_data, host);
 
 	thread = g_thread_new("obtain_cookie", (GThreadFunc)obtain_cookie, ui_data);
 	g_thread_unref(thread);
@@ -1611,12 +2068,42 @@ static void wait_for_quit (void)
 	g_string_free (str, TRUE);
 }
 
+/* Obtains the cookie without GTK, for the fastest or last used host, or
+   the first one. Returns 0 on success. */
+static int headless_obtain_cookie (auth_ui_data *ui_data)
+{
+	vpnhost *host;
+	int ret;
+
+	if (ui_data->token_mode != OC_TOKEN_MODE_NONE)
+		__openconnect_set_token_mode(ui_data->vpninfo, ui_data->token_mode, ui_data->token_secret);
+
+	for (host = vpnhosts; host; host = host->next) {
+		if (initial_host() && !strcmp(host->hostname, initial_host()))
+			break;
+	}
+	if (!host)
+		host = vpnhosts;
+
+	prepare_host(ui_data, host);
+
+	ret = openconnect_obtain_cookie(ui_data->vpninfo);
+	if (ret) {
+		fprintf(stderr, "Failed to obtain a cookie from '%s'\n", host->hostname);
+		return ret;
+	}
+
+	cookie_collect_secrets(ui_data);
+	return 0;
+}
+
 static struct option long_options[] = {
 	{"reprompt", 0, 0, 'r'},
 	{"uuid", 1, 0, 'u'},
 	{"name", 1, 0, 'n'},
 	{"service", 1, 0, 's'},
 	{"allow-interaction", 0, 0, 'i'},
+	{"headless", 0, 0, 'H'},
 	{NULL, 0, 0, 0},
 };
 
@@ -1642,12 +2129,15 @@ int main (int argc, char **argv)
 	char *vpn_name = NULL, *vpn_uuid = NULL, *vpn_service = NULL;
 	GHashTable *options = NULL, *secrets = NULL;
 	gboolean allow_interaction = FALSE;
+	gboolean headless = FALSE;
+	int headless_ret = 1;
+	char *probe, *opt_in;
 	GHashTableIter iter;
 	GThread *init_thread;
 	gchar *key, *value;
 	int opt;
 
-	while ((opt = getopt_long(argc, argv, "ru:n:s:i", long_options, NULL))) {
+	while ((opt = getopt_long(argc, argv, "ru:n:s:iH", long_options, NULL))) {
 		if (opt < 0)
 			break;
 
@@ -1660,6 +2150,10 @@ int main (int argc, char **argv)
 			allow_interaction = TRUE;
 			break;
 
+		case 'H':
+			headless = TRUE;
+			break;
+
 		case 'u':
 			vpn_uuid = optarg;
 			break;
@@ -1678,9 +2172,6 @@ int main (int argc, char **argv)
 		}
 	}
 
-	if (!allow_interaction)
-		return 0;
-
 	if (optind != argc) {
 		fprintf(stderr, "Superfluous command line options\n");
 		return 1;
@@ -1703,18 +2194,42 @@ int main (int argc, char **argv)
 		return 1;
 	}
 
-	gtk_init(0, NULL);
+	/* Without interaction there is nothing to do, unless the connection
+	   opted in to logging in with what is stored. If that fails, behave
+	   as if we had not tried. */
+	if (!allow_interaction && !headless) {
+		opt_in = g_hash_table_lookup (options, NM_OPENCONNECT_KEY_HEADLESS);
+		if (!opt_in || strcmp(opt_in, "yes"))
+			return 0;
+		headless = TRUE;
+		headless_ret = 0;
+	}
+
+	if (!headless)
+		gtk_init(0, NULL);
 
 	_ui_data = init_ui_data(vpn_name, options, secrets, vpn_uuid);
+	_ui_data->headless = headless;
 	if (get_config(_ui_data, options, secrets)) {
 		fprintf(stderr, "Failed to find VPN UUID %s\n", vpn_uuid);
-		return 1;
+		return headless_ret;
 	}
 
+	probe = g_hash_table_lookup (options, NM_OPENCONNECT_KEY_PROBE_GATEWAYS);
+	if (probe && !strcmp(probe, "yes"))
+		probe_gateways(_ui_data);
+
 #if OPENCONNECT_CHECK_VER(3,4)
 	openconnect_set_token_callbacks (_ui_data->vpninfo, _ui_data, NULL, update_token);
 #endif
 
+	if (headless) {
+		openconnect_init_ssl();
+		if (headless_obtain_cookie(_ui_data))
+			return headless_ret;
+		goto dump;
+	}
+
 	build_main_dialog(_ui_data);
 
 	openconnect_init_ssl();
@@ -1729,6 +2244,7 @@ int main (int argc, char **argv)
 	gtk_window_present(GTK_WINDOW(_ui_data->dialog));
 	gtk_main();
 
+ dump:
 	if (!g_hash_table_size (_ui_data->secrets))
 		return 0;
 
@@ -0,0 +1,143 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2012 Intel Corporation.
+ *
+ * Authors: Jussi Kukkonen <jku@linux.intel.com>
+ *          David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to:
+ *
+ *   Free Software Foundation, Inc.
+ *   51 Franklin Street, Fifth Floor,
+ *   Boston, MA 02110-1301 USA
+ */
+
+/* The server list of the AnyConnect XML profile. Kept apart from the
+   dialog, so that the tests can get at it without GTK or openconnect. */
+
+#include "nm-default.h"
+
+#include "xmlconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libxml/parser.h>
+#include <libxml/xmlreader.h>
+
+void free_vpnhosts(vpnhost *hosts)
+{
+	vpnhost *next;
+
+	while (hosts) {
+		next = hosts->next;
+		g_free(hosts->hostname);
+		g_free(hosts->hostaddress);
+		g_free(hosts->usergroup);
+		free(hosts);
+		hosts = next;
+	}
+}
+
+/* Returns the HostEntry elements of the server list, in order. The
+   profile is streamed through an xmlTextReader, so that only the
+   elements we care about are ever looked at; everything else is
+   skipped without building a tree. */
+vpnhost *parse_xmlconfig(const char *xmlconfig, gsize len)
+{
+	xmlTextReaderPtr reader;
+	struct vpnhost *hosts = NULL, *newhost = NULL, **list_end = &hosts;
+	gboolean in_list = FALSE;
+	int ret;
+
+	reader = xmlReaderForMemory(xmlconfig, len, "noname.xml", NULL, XML_PARSE_NONET);
+	if (!reader)
+		return NULL;
+
+	ret = xmlTextReaderRead(reader);
+	while (ret == 1) {
+		const char *name = (const char *)xmlTextReaderConstLocalName(reader);
+		int depth = xmlTextReaderDepth(reader);
+		char **field = NULL;
+
+		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_END_ELEMENT) {
+			if (depth == 2 && newhost) {
+				if (newhost->hostname && newhost->hostaddress) {
+					*list_end = newhost;
+					list_end = &newhost->next;
+				} else
+					free_vpnhosts(newhost);
+				newhost = NULL;
+			} else if (depth == 1 && in_list)
+				break;
+			ret = xmlTextReaderRead(reader);
+			continue;
+		}
+
+		if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT || depth == 0) {
+			ret = xmlTextReaderRead(reader);
+			continue;
+		}
+
+		if (depth == 1 && !in_list && !strcmp(name, "ServerList")) {
+			if (xmlTextReaderIsEmptyElement(reader))
+				break;
+			in_list = TRUE;
+			ret = xmlTextReaderRead(reader);
+			continue;
+		}
+
+		if (depth == 2 && in_list && !strcmp(name, "HostEntry") &&
+		    !xmlTextReaderIsEmptyElement(reader)) {
+			newhost = malloc(sizeof(*newhost));
+			if (!newhost) {
+				ret = -1;
+				break;
+			}
+			memset(newhost, 0, sizeof(*newhost));
+			ret = xmlTextReaderRead(reader);
+			continue;
+		}
+
+		if (depth == 3 && newhost) {
+			if (!strcmp(name, "HostName"))
+				field = &newhost->hostname;
+			else if (!strcmp(name, "HostAddress"))
+				field = &newhost->hostaddress;
+			else if (!strcmp(name, "UserGroup"))
+				field = &newhost->usergroup;
+		}
+		if (field) {
+			xmlChar *content = xmlTextReaderReadString(reader);
+
+			g_free(*field);
+			*field = g_strdup(content ? (char *)content : "");
+			xmlFree(content);
+		}
+
+		/* Done with this element, or not interested in it */
+		ret = xmlTextReaderNext(reader);
+	}
+
+	xmlFreeTextReader(reader);
+	free_vpnhosts(newhost);
+
+	if (ret < 0) {
+		fprintf(stderr, "Failed to parse XML profile\n");
+		free_vpnhosts(hosts);
+		return NULL;
+	}
+	return hosts;
+}
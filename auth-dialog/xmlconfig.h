@@ -0,0 +1,39 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2012 Intel Corporation.
+ *
+ * Authors: Jussi Kukkonen <jku@linux.intel.com>
+ *          David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to:
+ *
+ *   Free Software Foundation, Inc.
+ *   51 Franklin Street, Fifth Floor,
+ *   Boston, MA 02110-1301 USA
+ */
+
+#ifndef __NM_OPENCONNECT_XMLCONFIG_H__
+#define __NM_OPENCONNECT_XMLCONFIG_H__
+
+typedef struct vpnhost {
+	char *hostname;
+	char *hostaddress;
+	char *usergroup;
+	struct vpnhost *next;
+} vpnhost;
+
+void free_vpnhosts(vpnhost *hosts);
+vpnhost *parse_xmlconfig(const char *xmlconfig, gsize len);
+
+#endif /* __NM_OPENCONNECT_XMLCONFIG_H__ */
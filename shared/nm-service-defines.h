@@ -46,5 +46,7 @@
 #define NM_OPENCONNECT_KEY_CSD_WRAPPER "csd_wrapper"
 #define NM_OPENCONNECT_KEY_TOKEN_MODE "stoken_source"
 #define NM_OPENCONNECT_KEY_TOKEN_SECRET "stoken_string"
+#define NM_OPENCONNECT_KEY_PROBE_GATEWAYS "probe_gateways"
+#define NM_OPENCONNECT_KEY_HEADLESS "headless"
 
 #endif /* __NM_SERVICE_DEFINES_H__ */
@@ -0,0 +1,775 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *   Copyright © 2008 - 2010 Intel Corporation.
+ *
+ * Based on nm-vpnc-service-vpnc-helper.c:
+ *   Copyright © 2005 - 2010 Red Hat, Inc.
+ *   Copyright © 2007 - 2008 Novell, Inc.
+ */
+
+/* Translation of the environment openconnect passes to its script into
+ * the VPN plugin configuration dictionaries.  Shared by the helper and
+ * by nm-openconnect-service, which receives the environment forwarded
+ * by the helper. */
+
+#include "nm-default.h"
+
+#include "nm-openconnect-config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+#include "nm-utils/nm-shared-utils.h"
+#include "nm-utils/nm-vpn-plugin-macros.h"
+
+/*****************************************************************************/
+
+#define _NMLOG(level, ...) \
+	G_STMT_START { \
+		if (_log_level () >= (level)) { \
+			g_print ("nm-openconnect[%s] %-7s [config] " _NM_UTILS_MACRO_FIRST (__VA_ARGS__) "\n", \
+			         getenv ("NM_VPN_LOG_PREFIX_TOKEN") ?: "???", \
+			         nm_utils_syslog_to_str (level) \
+			         _NM_UTILS_MACRO_REST (__VA_ARGS__)); \
+		} \
+	} G_STMT_END
+
+#define _LOGD(...) _NMLOG(LOG_INFO,    __VA_ARGS__)
+#define _LOGW(...) _NMLOG(LOG_WARNING, __VA_ARGS__)
+
+static int
+_log_level (void)
+{
+	return _nm_utils_ascii_str_to_int64 (getenv ("NM_VPN_LOG_LEVEL"),
+	                                     10, 0, LOG_DEBUG,
+	                                     LOG_NOTICE);
+}
+
+/*****************************************************************************/
+
+/* All converters take the raw value of their variable, which may be
+ * %NULL, and the environment index for anything else they need. They
+ * return a floating variant, or %NULL if the value is empty or invalid. */
+typedef GVariant *(*ConfigConvertFunc) (const char *str, GHashTable *env);
+
+static GHashTable *
+env_index_new (const char *const *envp)
+{
+	GHashTable *env;
+	const char *eq;
+
+	env = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	for (; envp && *envp; envp++) {
+		char *key;
+
+		eq = strchr (*envp, '=');
+		if (!eq)
+			continue;
+
+		/* Like getenv(), the first definition wins */
+		key = g_strndup (*envp, eq - *envp);
+		if (g_hash_table_contains (env, key))
+			g_free (key);
+		else
+			g_hash_table_insert (env, key, (gpointer) (eq + 1));
+	}
+	return env;
+}
+
+static GVariant *
+str_to_gvariant (const char *str, gboolean try_convert)
+{
+
+	/* Empty */
+	if (!str || strlen (str) < 1)
+		return NULL;
+
+	if (!g_utf8_validate (str, -1, NULL)) {
+		if (try_convert && !(str = g_convert (str, -1, "ISO-8859-1", "UTF-8", NULL, NULL, NULL)))
+			str = g_convert (str, -1, "C", "UTF-8", NULL, NULL, NULL);
+
+		if (!str)
+			/* Invalid */
+			return NULL;
+	}
+
+	return g_variant_new_string (str);
+}
+
+static GVariant *
+string_to_gvariant (const char *str, GHashTable *env)
+{
+	return str_to_gvariant (str, FALSE);
+}
+
+/* Server-provided text, which may not be UTF-8 */
+static GVariant *
+text_to_gvariant (const char *str, GHashTable *env)
+{
+	return str_to_gvariant (str, TRUE);
+}
+
+static GVariant *
+addr4_to_gvariant (const char *str, GHashTable *env)
+{
+	struct in_addr	temp_addr;
+
+	/* Empty */
+	if (!str || strlen (str) < 1)
+		return NULL;
+
+	if (inet_pton (AF_INET, str, &temp_addr) <= 0)
+		return NULL;
+
+	return g_variant_new_uint32 (temp_addr.s_addr);
+}
+
+/* Returns the next token of the list at *@str, separated by any of
+ * @delims, and advances *@str past it. Empty tokens are skipped and
+ * nothing is copied: the token is not NUL-terminated. */
+static gboolean
+list_next_token (const char **str, const char *delims,
+                 const char **out_token, gsize *out_len)
+{
+	const char *p = *str + strspn (*str, delims);
+
+	if (!*p)
+		return FALSE;
+
+	*out_token = p;
+	*out_len = strcspn (p, delims);
+	*str = p + *out_len;
+	return TRUE;
+}
+
+static gboolean
+list_token_to_addr (int family, const char *token, gsize len, void *out_addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (len >= sizeof (buf))
+		return FALSE;
+
+	memcpy (buf, token, len);
+	buf[len] = '\0';
+	return inet_pton (family, buf, out_addr) > 0;
+}
+
+static GVariant *
+addr4_list_to_gvariant (const char *str, GHashTable *env)
+{
+	GVariantBuilder builder;
+	const char *token;
+	gsize len;
+	gboolean empty = TRUE;
+
+	if (!str)
+		return NULL;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("au"));
+
+	while (list_next_token (&str, " ", &token, &len)) {
+		struct in_addr addr;
+
+		if (!list_token_to_addr (AF_INET, token, len, &addr)) {
+			g_variant_builder_clear (&builder);
+			return NULL;
+		}
+		g_variant_builder_add (&builder, "u", addr.s_addr);
+		empty = FALSE;
+	}
+
+	if (empty) {
+		g_variant_builder_clear (&builder);
+		return NULL;
+	}
+	return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+addr6_to_gvariant (const char *str, GHashTable *env)
+{
+	struct in6_addr temp_addr;
+	GVariantBuilder builder;
+	int i;
+
+	/* Empty */
+	if (!str || strlen (str) < 1)
+		return NULL;
+
+	if (inet_pton (AF_INET6, str, &temp_addr) <= 0)
+		return NULL;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("ay"));
+	for (i = 0; i < sizeof (temp_addr); i++)
+		g_variant_builder_add (&builder, "y", ((guint8 *) &temp_addr)[i]);
+	return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+addr6_list_to_gvariant (const char *str, GHashTable *env)
+{
+	GVariantBuilder builder;
+	const char *token;
+	gsize len;
+	gboolean empty = TRUE;
+
+	if (!str)
+		return NULL;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("aay"));
+
+	while (list_next_token (&str, " ", &token, &len)) {
+		struct in6_addr addr;
+
+		if (!list_token_to_addr (AF_INET6, token, len, &addr)) {
+			g_variant_builder_clear (&builder);
+			return NULL;
+		}
+		g_variant_builder_add_value (&builder,
+		                             g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, &addr, sizeof (addr), 1));
+		empty = FALSE;
+	}
+
+	if (empty) {
+		g_variant_builder_clear (&builder);
+		return NULL;
+	}
+	return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+gateway_to_gvariant (const char *str, GHashTable *env)
+{
+	return addr4_to_gvariant (str, env) ?: addr6_to_gvariant (str, env);
+}
+
+static GVariant *
+mtu_to_gvariant (const char *str, GHashTable *env)
+{
+	long int mtu;
+
+	if (!str || !strlen (str))
+		return NULL;
+
+	errno = 0;
+	mtu = strtol (str, NULL, 10);
+	if (errno || mtu < 0 || mtu > 20000) {
+		_LOGW ("Ignoring invalid tunnel MTU '%s'", str);
+		return NULL;
+	}
+	return g_variant_new_uint32 ((guint32) mtu);
+}
+
+static GVariant *
+netmask4_to_gvariant (const char *str, GHashTable *env)
+{
+	struct in_addr temp_addr;
+
+	if (!str || inet_pton (AF_INET, str, &temp_addr) <= 0)
+		return NULL;
+
+	return g_variant_new_uint32 (nm_utils_ip4_netmask_to_prefix (temp_addr.s_addr));
+}
+
+/* INTERNAL_IP6_NETMASK is in address/prefix form */
+static GVariant *
+netmask6_to_gvariant (const char *str, GHashTable *env)
+{
+	if (str)
+		str = strchr (str, '/');
+	if (!str)
+		return NULL;
+
+	return g_variant_new_uint32 (strtol (str + 1, NULL, 10));
+}
+
+static GVariant *
+split_dns_list_to_gvariant (const char *str, GHashTable *env)
+{
+	GVariantBuilder builder;
+	const char *token;
+	gsize len;
+	gboolean empty = TRUE;
+
+	if (!str)
+		return NULL;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_STRING_ARRAY);
+
+	while (list_next_token (&str, ", ", &token, &len)) {
+		char buf[256]; /* fits any valid domain name */
+		char *domain;
+
+		if (!g_utf8_validate (token, len, NULL)) {
+			g_variant_builder_clear (&builder);
+			return NULL;
+		}
+		if (len < sizeof (buf)) {
+			domain = memcpy (buf, token, len);
+			domain[len] = '\0';
+			g_variant_builder_add (&builder, "s", domain);
+		} else {
+			domain = g_strndup (token, len);
+			g_variant_builder_add (&builder, "s", domain);
+			g_free (domain);
+		}
+		empty = FALSE;
+	}
+
+	if (empty) {
+		g_variant_builder_clear (&builder);
+		return NULL;
+	}
+	return g_variant_builder_end (&builder);
+}
+
+/*****************************************************************************/
+
+/* Split-include lists can run into thousands of entries. Routes are
+ * parsed into a flat array, coalesced (covered prefixes dropped, sibling
+ * prefixes merged) and only then turned into a variant in one go. All
+ * of them have no next hop and the default metric, so coalescing does
+ * not change what gets routed through the tunnel. */
+
+typedef struct {
+	guint8 addr[16];        /* network byte order, host bits cleared */
+	guint8 plen;
+} ConfigRoute;
+
+static int
+route_cmp (gconstpointer a, gconstpointer b)
+{
+	const ConfigRoute *ra = a, *rb = b;
+	int c;
+
+	c = memcmp (ra->addr, rb->addr, sizeof (ra->addr));
+	if (c)
+		return c;
+	return (int) ra->plen - (int) rb->plen;
+}
+
+static gboolean
+route_prefix_equal (const ConfigRoute *a, const ConfigRoute *b, guint plen)
+{
+	if (memcmp (a->addr, b->addr, plen / 8))
+		return FALSE;
+	if (plen % 8 && (a->addr[plen / 8] ^ b->addr[plen / 8]) & (0xFF << (8 - plen % 8)))
+		return FALSE;
+	return TRUE;
+}
+
+static void
+route_add (GArray *routes, const void *addr, guint addr_len, guint plen)
+{
+	ConfigRoute r = { { 0 }, plen };
+	guint i = plen / 8;
+
+	memcpy (r.addr, addr, addr_len);
+	if (plen % 8)
+		r.addr[i++] &= 0xFF << (8 - plen % 8);
+	if (i < addr_len)
+		memset (&r.addr[i], 0, addr_len - i);
+	g_array_append_val (routes, r);
+}
+
+static void
+routes_coalesce (GArray *routes)
+{
+	ConfigRoute *out = (ConfigRoute *) routes->data;
+	guint i, n = 0;
+
+	g_array_sort (routes, route_cmp);
+
+	for (i = 0; i < routes->len; i++) {
+		ConfigRoute r = out[i];
+
+		/* Duplicate, or inside the previous prefix */
+		if (n && out[n - 1].plen <= r.plen && route_prefix_equal (&out[n - 1], &r, out[n - 1].plen))
+			continue;
+		out[n++] = r;
+
+		/* Two halves of the same parent make the parent */
+		while (   n >= 2
+		       && out[n - 2].plen == out[n - 1].plen
+		       && out[n - 1].plen > 0
+		       && route_prefix_equal (&out[n - 2], &out[n - 1], out[n - 1].plen - 1)) {
+			out[n - 2].plen--;
+			n--;
+		}
+	}
+
+	g_array_set_size (routes, n);
+}
+
+static gboolean
+route_prefix_parse (const char *str, long int max, guint *out_plen)
+{
+	long int tmp_prefix;
+
+	errno = 0;
+	tmp_prefix = strtol (str, NULL, 10);
+	if (errno || tmp_prefix <= 0 || tmp_prefix > max) {
+		_LOGW ("Ignoring invalid static route prefix '%s'", str);
+		return FALSE;
+	}
+	*out_plen = tmp_prefix;
+	return TRUE;
+}
+
+#define BUFLEN 256
+
+/* The count comes from the server. Every route takes at least one
+ * variable of its own, so anything beyond the size of the environment
+ * can only point at routes that aren't there. */
+static int
+route_count_parse (const char *str, GHashTable *env)
+{
+	gint64 num;
+
+	num = _nm_utils_ascii_str_to_int64 (str, 10, 0, G_MAXINT, 0);
+	if (num > g_hash_table_size (env)) {
+		_LOGW ("Route count %" G_GINT64_FORMAT " exceeds the %u variables we got, capping it",
+		       num, g_hash_table_size (env));
+		num = g_hash_table_size (env);
+	}
+	return num;
+}
+
+/* @str is the route count, the routes themselves are in numbered variables */
+static GVariant *
+ip4_routes_to_gvariant (const char *str, GHashTable *env)
+{
+	GVariant **children;
+	GVariant *value;
+	GArray *routes;
+	const char *tmp;
+	char buf[BUFLEN];
+	guint n_parsed;
+	int num, i;
+
+	if (!str || strlen (str) < 1)
+		return NULL;
+
+	num = route_count_parse (str, env);
+	if (num <= 0)
+		return NULL;
+
+	routes = g_array_new (FALSE, FALSE, sizeof (ConfigRoute));
+
+	for (i = 0; i < num; i++) {
+		struct in_addr network;
+		guint prefix;
+
+		snprintf (buf, BUFLEN, "CISCO_SPLIT_INC_%d_ADDR", i);
+		tmp = g_hash_table_lookup (env, buf);
+		if (!tmp || inet_pton (AF_INET, tmp, &network) <= 0) {
+			_LOGW ("Ignoring invalid static route address '%s'", tmp ? tmp : "NULL");
+			continue;
+		}
+
+		snprintf (buf, BUFLEN, "CISCO_SPLIT_INC_%d_MASKLEN", i);
+		tmp = g_hash_table_lookup (env, buf);
+		if (tmp) {
+			if (!route_prefix_parse (tmp, 32, &prefix))
+				continue;
+		} else {
+			struct in_addr netmask;
+
+			snprintf (buf, BUFLEN, "CISCO_SPLIT_INC_%d_MASK", i);
+			tmp = g_hash_table_lookup (env, buf);
+			if (!tmp || inet_pton (AF_INET, tmp, &netmask) <= 0) {
+				_LOGW ("Ignoring invalid static route netmask '%s'", tmp ? tmp : "NULL");
+				continue;
+			}
+			prefix = nm_utils_ip4_netmask_to_prefix (netmask.s_addr);
+		}
+
+		route_add (routes, &network, sizeof (network), prefix);
+	}
+
+	n_parsed = routes->len;
+	routes_coalesce (routes);
+	if (routes->len < n_parsed)
+		_LOGD ("Coalesced %u IPv4 split routes into %u", n_parsed, routes->len);
+
+	if (!routes->len) {
+		g_array_unref (routes);
+		return NULL;
+	}
+
+	/* [network, prefix, next hop, metric] */
+	children = g_new (GVariant *, routes->len);
+	for (i = 0; i < routes->len; i++) {
+		const ConfigRoute *r = &g_array_index (routes, ConfigRoute, i);
+		guint32 route[4] = { 0, r->plen, 0, 0 };
+
+		memcpy (&route[0], r->addr, sizeof (route[0]));
+		children[i] = g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, route, 4, sizeof (guint32));
+	}
+	value = g_variant_new_array (G_VARIANT_TYPE ("au"), children, routes->len);
+
+	g_free (children);
+	g_array_unref (routes);
+	return value;
+}
+
+static GVariant *
+ip6_routes_to_gvariant (const char *str, GHashTable *env)
+{
+	static const guint8 no_next_hop[16];
+	GVariant **children;
+	GVariant *value;
+	GArray *routes;
+	const char *tmp;
+	char buf[BUFLEN];
+	guint n_parsed;
+	int num, i;
+
+	if (!str || strlen (str) < 1)
+		return NULL;
+
+	num = route_count_parse (str, env);
+	if (num <= 0)
+		return NULL;
+
+	routes = g_array_new (FALSE, FALSE, sizeof (ConfigRoute));
+
+	for (i = 0; i < num; i++) {
+		struct in6_addr network;
+		guint prefix;
+
+		snprintf (buf, BUFLEN, "CISCO_IPV6_SPLIT_INC_%d_ADDR", i);
+		tmp = g_hash_table_lookup (env, buf);
+		if (!tmp || inet_pton (AF_INET6, tmp, &network) <= 0) {
+			_LOGW ("Ignoring invalid static route address '%s'", tmp ? tmp : "NULL");
+			continue;
+		}
+
+		snprintf (buf, BUFLEN, "CISCO_IPV6_SPLIT_INC_%d_MASKLEN", i);
+		tmp = g_hash_table_lookup (env, buf);
+		if (!tmp) {
+			_LOGW ("Ignoring static route %d with no prefix length", i);
+			continue;
+		}
+		if (!route_prefix_parse (tmp, 128, &prefix))
+			continue;
+
+		route_add (routes, &network, sizeof (network), prefix);
+	}
+
+	n_parsed = routes->len;
+	routes_coalesce (routes);
+	if (routes->len < n_parsed)
+		_LOGD ("Coalesced %u IPv6 split routes into %u", n_parsed, routes->len);
+
+	if (!routes->len) {
+		g_array_unref (routes);
+		return NULL;
+	}
+
+	/* The a(ayuayu) format of nm_utils_ip6_routes_to_variant() */
+	children = g_new (GVariant *, routes->len);
+	for (i = 0; i < routes->len; i++) {
+		const ConfigRoute *r = &g_array_index (routes, ConfigRoute, i);
+
+		children[i] = g_variant_new ("(@ayu@ayu)",
+		                             g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, r->addr, 16, 1),
+		                             (guint32) r->plen,
+		                             g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE, no_next_hop, 16, 1),
+		                             (guint32) 0);
+	}
+	value = g_variant_new_array (G_VARIANT_TYPE ("(ayuayu)"), children, routes->len);
+
+	g_free (children);
+	g_array_unref (routes);
+	return value;
+}
+
+/*****************************************************************************/
+
+typedef enum {
+	CONFIG_TARGET_GENERAL,
+	CONFIG_TARGET_IP4,
+	CONFIG_TARGET_IP6,
+	_CONFIG_TARGET_NUM,
+} ConfigTarget;
+
+typedef enum {
+	/* Fail if there is no valid value */
+	CONFIG_ITEM_REQUIRED      = (1 << 0),
+	/* Fail if a value is present but invalid; a valid one enables the family */
+	CONFIG_ITEM_ADDRESS       = (1 << 1),
+	/* Only used if the item before it produced nothing */
+	CONFIG_ITEM_FALLBACK      = (1 << 2),
+	/* Routes were provided, so the tunnel must not be the default route */
+	CONFIG_ITEM_NEVER_DEFAULT = (1 << 3),
+} ConfigItemFlags;
+
+typedef struct {
+	const char *env;
+	ConfigConvertFunc convert;
+	ConfigTarget target;
+	const char *key;
+	ConfigItemFlags flags;
+	const char *failure;
+} ConfigItem;
+
+/*
+ * Environment variables passed back from 'openconnect':
+ *
+ * VPNGATEWAY             -- vpn gateway address (always present)
+ * TUNDEV                 -- tunnel device (always present)
+ * INTERNAL_IP4_ADDRESS   -- address (always present)
+ * INTERNAL_IP4_NETMASK   -- netmask (often unset)
+ * INTERNAL_IP4_DNS       -- list of dns serverss
+ * INTERNAL_IP4_NBNS      -- list of wins servers
+ * CISCO_DEF_DOMAIN       -- default domain name
+ * CISCO_SPLIT_DNS        -- default domain name
+ * CISCO_BANNER           -- banner from server
+ *
+ * We have two environment variables with domains -- CISCO_SPLIT_DNS and
+ * CISCO_DEF_DOMAIN. On Cisco, CISCO_DEF_DOMAIN can only be a single
+ * domain, while CISCO_SPLIT_DNS can have multiple domains separated by
+ * comma. On Juniper, CISCO_SPLIT_DNS is not supported but
+ * CISCO_DEF_DOMAIN can have multiple domains separated by ", ". The
+ * upshot of all this is we use CISCO_SPLIT_DNS if available,
+ * CISCO_DEF_DOMAIN if not.
+ *
+ * For openconnect the PTP address is the internal address.
+ */
+static const ConfigItem config_items[] = {
+	{ "VPNGATEWAY",           gateway_to_gvariant,        CONFIG_TARGET_GENERAL, NM_VPN_PLUGIN_CONFIG_EXT_GATEWAY,       CONFIG_ITEM_REQUIRED,      "VPN Gateway" },
+	{ "TUNDEV",               string_to_gvariant,         CONFIG_TARGET_GENERAL, NM_VPN_PLUGIN_CONFIG_TUNDEV,            CONFIG_ITEM_REQUIRED,      "Tunnel Device" },
+	{ "CISCO_BANNER",         text_to_gvariant,           CONFIG_TARGET_GENERAL, NM_VPN_PLUGIN_CONFIG_BANNER },
+	{ "CISCO_PROXY_PAC",      text_to_gvariant,           CONFIG_TARGET_GENERAL, NM_VPN_PLUGIN_CONFIG_PROXY_PAC },
+	{ "INTERNAL_IP4_MTU",     mtu_to_gvariant,            CONFIG_TARGET_GENERAL, NM_VPN_PLUGIN_CONFIG_MTU },
+
+	{ "INTERNAL_IP4_ADDRESS", addr4_to_gvariant,          CONFIG_TARGET_IP4,     NM_VPN_PLUGIN_IP4_CONFIG_ADDRESS,       CONFIG_ITEM_ADDRESS,       "IP4 Address" },
+	{ "INTERNAL_IP4_ADDRESS", addr4_to_gvariant,          CONFIG_TARGET_IP4,     NM_VPN_PLUGIN_IP4_CONFIG_PTP,           CONFIG_ITEM_ADDRESS,       "IP4 Address" },
+	{ "INTERNAL_IP4_NETMASK", netmask4_to_gvariant,       CONFIG_TARGET_IP4,     NM_VPN_PLUGIN_IP4_CONFIG_PREFIX },
+	{ "INTERNAL_IP4_DNS",     addr4_list_to_gvariant,     CONFIG_TARGET_IP4,     NM_VPN_PLUGIN_IP4_CONFIG_DNS },
+	{ "INTERNAL_IP4_NBNS",    addr4_list_to_gvariant,     CONFIG_TARGET_IP4,     NM_VPN_PLUGIN_IP4_CONFIG_NBNS },
+	{ "CISCO_SPLIT_DNS",      split_dns_list_to_gvariant, CONFIG_TARGET_IP4,     NM_VPN_PLUGIN_IP4_CONFIG_DOMAINS },
+	{ "CISCO_DEF_DOMAIN",     split_dns_list_to_gvariant, CONFIG_TARGET_IP4,     NM_VPN_PLUGIN_IP4_CONFIG_DOMAINS,       CONFIG_ITEM_FALLBACK },
+	{ "CISCO_SPLIT_INC",      ip4_routes_to_gvariant,     CONFIG_TARGET_IP4,     NM_VPN_PLUGIN_IP4_CONFIG_ROUTES,        CONFIG_ITEM_NEVER_DEFAULT },
+
+	{ "CISCO_DEF_DOMAIN",     text_to_gvariant,           CONFIG_TARGET_IP6,     NM_VPN_PLUGIN_IP6_CONFIG_DOMAIN },
+	{ "INTERNAL_IP6_ADDRESS", addr6_to_gvariant,          CONFIG_TARGET_IP6,     NM_VPN_PLUGIN_IP6_CONFIG_ADDRESS,       CONFIG_ITEM_ADDRESS,       "IP6 Address" },
+	{ "INTERNAL_IP6_ADDRESS", addr6_to_gvariant,          CONFIG_TARGET_IP6,     NM_VPN_PLUGIN_IP6_CONFIG_PTP,           CONFIG_ITEM_ADDRESS,       "IP6 PTP Address" },
+	{ "INTERNAL_IP6_NETMASK", netmask6_to_gvariant,       CONFIG_TARGET_IP6,     NM_VPN_PLUGIN_IP6_CONFIG_PREFIX },
+	{ "INTERNAL_IP6_DNS",     addr6_list_to_gvariant,     CONFIG_TARGET_IP6,     NM_VPN_PLUGIN_IP6_CONFIG_DNS },
+	{ "CISCO_IPV6_SPLIT_INC", ip6_routes_to_gvariant,     CONFIG_TARGET_IP6,     NM_VPN_PLUGIN_IP6_CONFIG_ROUTES,        CONFIG_ITEM_NEVER_DEFAULT },
+};
+
+/* On success returns references to the three dictionaries; @out_ip4config
+ * and @out_ip6config are set to %NULL if the family is not configured.
+ * On failure, @out_failure names the item that was missing or invalid. */
+gboolean
+nm_openconnect_config_from_env (const char *const *envp,
+                                GVariant **out_config,
+                                GVariant **out_ip4config,
+                                GVariant **out_ip6config,
+                                const char **out_failure)
+{
+	GVariantBuilder builders[_CONFIG_TARGET_NUM];
+	gboolean has_family[_CONFIG_TARGET_NUM] = { FALSE, };
+	GVariant *ip4config, *ip6config;
+	GHashTable *env;
+	gboolean prev_set = FALSE;
+	const char *failure = NULL;
+	guint i;
+
+	env = env_index_new (envp);
+
+	for (i = 0; i < _CONFIG_TARGET_NUM; i++)
+		g_variant_builder_init (&builders[i], G_VARIANT_TYPE_VARDICT);
+
+	for (i = 0; i < G_N_ELEMENTS (config_items); i++) {
+		const ConfigItem *item = &config_items[i];
+		GVariantBuilder *builder = &builders[item->target];
+		const char *str;
+		GVariant *val;
+
+		if ((item->flags & CONFIG_ITEM_FALLBACK) && prev_set)
+			continue;
+
+		str = g_hash_table_lookup (env, item->env);
+		val = item->convert (str, env);
+		prev_set = !!val;
+
+		if (!val) {
+			if (   (item->flags & CONFIG_ITEM_REQUIRED)
+			    || ((item->flags & CONFIG_ITEM_ADDRESS) && str && *str)) {
+				failure = item->failure;
+				goto fail;
+			}
+			continue;
+		}
+
+		g_variant_builder_add (builder, "{sv}", item->key, val);
+
+		if (item->flags & CONFIG_ITEM_ADDRESS)
+			has_family[item->target] = TRUE;
+		if (item->flags & CONFIG_ITEM_NEVER_DEFAULT) {
+			g_variant_builder_add (builder, "{sv}",
+			                       item->target == CONFIG_TARGET_IP4
+			                       ? NM_VPN_PLUGIN_IP4_CONFIG_NEVER_DEFAULT
+			                       : NM_VPN_PLUGIN_IP6_CONFIG_NEVER_DEFAULT,
+			                       g_variant_new_boolean (TRUE));
+		}
+	}
+
+	g_hash_table_unref (env);
+
+	ip4config = g_variant_ref_sink (g_variant_builder_end (&builders[CONFIG_TARGET_IP4]));
+	if (has_family[CONFIG_TARGET_IP4]) {
+		g_variant_builder_add (&builders[CONFIG_TARGET_GENERAL], "{sv}",
+		                       NM_VPN_PLUGIN_CONFIG_HAS_IP4, g_variant_new_boolean (TRUE));
+	} else
+		g_clear_pointer (&ip4config, g_variant_unref);
+
+	ip6config = g_variant_ref_sink (g_variant_builder_end (&builders[CONFIG_TARGET_IP6]));
+	if (has_family[CONFIG_TARGET_IP6]) {
+		g_variant_builder_add (&builders[CONFIG_TARGET_GENERAL], "{sv}",
+		                       NM_VPN_PLUGIN_CONFIG_HAS_IP6, g_variant_new_boolean (TRUE));
+	} else
+		g_clear_pointer (&ip6config, g_variant_unref);
+
+	*out_config = g_variant_ref_sink (g_variant_builder_end (&builders[CONFIG_TARGET_GENERAL]));
+	*out_ip4config = ip4config;
+	*out_ip6config = ip6config;
+	return TRUE;
+
+fail:
+	_LOGW ("Did not receive a valid %s from openconnect", failure);
+	g_hash_table_unref (env);
+	for (i = 0; i < _CONFIG_TARGET_NUM; i++)
+		g_variant_builder_clear (&builders[i]);
+	*out_config = NULL;
+	*out_ip4config = NULL;
+	*out_ip6config = NULL;
+	if (out_failure)
+		*out_failure = failure;
+	return FALSE;
+}
@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __NM_OPENCONNECT_CONFIG_H__
+#define __NM_OPENCONNECT_CONFIG_H__
+
+/* The helper forwards its environment to nm-openconnect-service over the
+ * file descriptor named by this variable, if set. */
+#define NM_OPENCONNECT_HELPER_FD_ENV "NM_OPENCONNECT_HELPER_FD"
+
+/* Upper bound for one forwarded environment block */
+#define NM_OPENCONNECT_HELPER_MAX_MSG (16 * 1024 * 1024)
+
+gboolean nm_openconnect_config_from_env (const char *const *envp,
+                                         GVariant **out_config,
+                                         GVariant **out_ip4config,
+                                         GVariant **out_ip6config,
+                                         const char **out_failure);
+
+#endif /* __NM_OPENCONNECT_CONFIG_H__ */
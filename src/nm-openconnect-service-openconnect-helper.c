@@ -27,21 +27,27 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include "nm-utils/nm-shared-utils.h"
 #include "nm-utils/nm-vpn-plugin-macros.h"
 
+#include "nm-openconnect-config.h"
+
 extern char **environ;
 
 /*****************************************************************************/
 
+/* Timeout for each D-Bus call, in milliseconds */
+#define NM_OPENCONNECT_HELPER_TIMEOUT_ENV "NM_OPENCONNECT_HELPER_TIMEOUT"
+#define NM_OPENCONNECT_HELPER_TIMEOUT_DEFAULT 25000
+
 static struct {
 	int log_level;
 	const char *log_prefix_token;
+	int dbus_timeout;
+	const char *bus_name;
 } gl/*obal*/;
 
 /*****************************************************************************/
@@ -69,17 +75,25 @@ _LOGD_enabled (void)
 /*****************************************************************************/
 
 static void
-helper_failed (GDBusProxy *proxy, const char *reason)
+helper_failed (GDBusConnection *connection, const char *reason)
 {
+	GVariant *ret;
 	GError *err = NULL;
 
 	_LOGW ("nm-nopenconnect-service-openconnect-helper did not receive a valid %s from openconnect", reason);
 
-	if (!g_dbus_proxy_call_sync (proxy, "SetFailure",
-	                             g_variant_new ("(s)", reason),
-	                             G_DBUS_CALL_FLAGS_NONE, -1,
-	                             NULL,
-	                             &err)) {
+	ret = g_dbus_connection_call_sync (connection, gl.bus_name,
+	                                   NM_VPN_DBUS_PLUGIN_PATH,
+	                                   NM_VPN_DBUS_PLUGIN_INTERFACE,
+	                                   "SetFailure",
+	                                   g_variant_new ("(s)", reason),
+	                                   NULL,
+	                                   G_DBUS_CALL_FLAGS_NONE, gl.dbus_timeout,
+	                                   NULL,
+	                                   &err);
+	if (ret)
+		g_variant_unref (ret);
+	else {
 		_LOGW ("Could not send failure information: %s", err->message);
 		g_error_free (err);
 	}
@@ -87,370 +101,141 @@ helper_failed (GDBusProxy *proxy, const char *reason)
 	exit (1);
 }
 
-static void
-send_config (GDBusProxy *proxy, GVariant *config,
-             GVariant *ip4config, GVariant *ip6config)
-{
-	GError *err = NULL;
-
-	if (!g_dbus_proxy_call_sync (proxy, "SetConfig",
-	                             g_variant_new ("(*)", config),
-	                             G_DBUS_CALL_FLAGS_NONE, -1,
-	                             NULL,
-	                             &err))
-		goto error;
-
-	if (ip4config) {
-		if (!g_dbus_proxy_call_sync (proxy, "SetIp4Config",
-	                                     g_variant_new ("(*)", ip4config),
-		                             G_DBUS_CALL_FLAGS_NONE, -1,
-		                             NULL,
-		                             &err))
-			goto error;
-	}
-
-	if (ip6config) {
-		if (!g_dbus_proxy_call_sync (proxy, "SetIp6Config",
-	                                     g_variant_new ("(*)", ip6config),
-		                             G_DBUS_CALL_FLAGS_NONE, -1,
-		                             NULL,
-		                             &err))
-			goto error;
-	}
-
-	return;
-error:
-	_LOGW ("Could not send configuration information: %s", err->message);
-	g_error_free (err);
-}
-
-
-static GVariant *
-str_to_gvariant (const char *str, gboolean try_convert)
-{
+/* The configuration calls are issued back to back on one connection,
+ * which keeps them in order, and we only wait once for all
+ * the replies. */
+typedef struct {
+	GMainLoop *loop;
+	guint pending;
+} SendConfigData;
 
-	/* Empty */
-	if (!str || strlen (str) < 1)
-		return NULL;
+typedef struct {
+	SendConfigData *data;
+	const char *method;
+	gint64 start;
+} SendConfigCall;
 
-	if (!g_utf8_validate (str, -1, NULL)) {
-		if (try_convert && !(str = g_convert (str, -1, "ISO-8859-1", "UTF-8", NULL, NULL, NULL)))
-			str = g_convert (str, -1, "C", "UTF-8", NULL, NULL, NULL);
-
-		if (!str)
-			/* Invalid */
-			return NULL;
-	}
-
-	return g_variant_new_string (str);
-}
-
-static GVariant *
-addr4_to_gvariant (const char *str)
-{
-	struct in_addr	temp_addr;
-
-	/* Empty */
-	if (!str || strlen (str) < 1)
-		return NULL;
-
-	if (inet_pton (AF_INET, str, &temp_addr) <= 0)
-		return NULL;
-
-	return g_variant_new_uint32 (temp_addr.s_addr);
-}
-
-static GVariant *
-addr4_list_to_gvariant (const char *str)
+static void
+send_config_cb (GObject *source, GAsyncResult *result, gpointer user_data)
 {
-	GVariantBuilder builder;
-	char **split;
-	int i;
-
-	/* Empty */
-	if (!str || strlen (str) < 1)
-		return NULL;
-
-	split = g_strsplit (str, " ", -1);
-	if (g_strv_length (split) == 0)
-		return NULL;
-
-	g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
-
-	for (i = 0; split[i]; i++) {
-		struct in_addr addr;
+	SendConfigCall *call = user_data;
+	SendConfigData *data = call->data;
+	GVariant *ret;
+	GError *err = NULL;
 
-		if (inet_pton (AF_INET, split[i], &addr) > 0) {
-			g_variant_builder_add_value (&builder, g_variant_new_uint32 (addr.s_addr));
-		} else {
-			g_strfreev (split);
-			g_variant_unref (g_variant_builder_end (&builder));
-			return NULL;
-		}
+	ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &err);
+	if (ret) {
+		_LOGD ("%s completed in %" G_GINT64_FORMAT " ms", call->method,
+		       (g_get_monotonic_time () - call->start) / 1000);
+		g_variant_unref (ret);
+	} else {
+		_LOGW ("Could not send configuration information (%s): %s", call->method, err->message);
+		g_error_free (err);
 	}
 
-	g_strfreev (split);
-
-	return g_variant_builder_end (&builder);
+	g_slice_free (SendConfigCall, call);
+	if (--data->pending == 0)
+		g_main_loop_quit (data->loop);
 }
 
-static GVariant *
-addr6_to_gvariant (const char *str)
+static void
+send_config_call (GDBusConnection *connection, SendConfigData *data,
+                  const char *method, GVariant *value)
 {
-	struct in6_addr temp_addr;
-	GVariantBuilder builder;
-	int i;
-
-	/* Empty */
-	if (!str || strlen (str) < 1)
-		return NULL;
-
-	if (inet_pton (AF_INET6, str, &temp_addr) <= 0)
-		return NULL;
-
-	g_variant_builder_init (&builder, G_VARIANT_TYPE ("ay"));
-	for (i = 0; i < sizeof (temp_addr); i++)
-		g_variant_builder_add (&builder, "y", ((guint8 *) &temp_addr)[i]);
-	return g_variant_builder_end (&builder);
+	SendConfigCall *call;
+
+	call = g_slice_new (SendConfigCall);
+	call->data = data;
+	call->method = method;
+	call->start = g_get_monotonic_time ();
+
+	g_dbus_connection_call (connection, gl.bus_name,
+	                        NM_VPN_DBUS_PLUGIN_PATH,
+	                        NM_VPN_DBUS_PLUGIN_INTERFACE,
+	                        method,
+	                        g_variant_new ("(*)", value),
+	                        NULL,
+	                        G_DBUS_CALL_FLAGS_NONE, gl.dbus_timeout,
+	                        NULL,
+	                        send_config_cb, call);
+	data->pending++;
 }
 
-static GVariant *
-addr6_list_to_gvariant (const char *str)
+static void
+send_config (GDBusConnection *connection, GVariant *config,
+             GVariant *ip4config, GVariant *ip6config)
 {
-	GVariantBuilder builder;
-	char **split;
-	int i;
-
-	/* Empty */
-	if (!str || strlen (str) < 1)
-		return NULL;
+	SendConfigData data = { 0 };
+	gint64 start = g_get_monotonic_time ();
 
-	split = g_strsplit (str, " ", -1);
-	if (g_strv_length (split) == 0)
-		return NULL;
+	data.loop = g_main_loop_new (NULL, FALSE);
 
-	g_variant_builder_init (&builder, G_VARIANT_TYPE ("aay"));
+	send_config_call (connection, &data, "SetConfig", config);
+	if (ip4config)
+		send_config_call (connection, &data, "SetIp4Config", ip4config);
+	if (ip6config)
+		send_config_call (connection, &data, "SetIp6Config", ip6config);
 
-	for (i = 0; split[i]; i++) {
-		GVariant *val = addr6_to_gvariant (split[i]);
+	g_main_loop_run (data.loop);
+	g_main_loop_unref (data.loop);
 
-		if (val) {
-			g_variant_builder_add_value (&builder, val);
-		} else {
-			g_strfreev (split);
-			g_variant_unref (g_variant_builder_end (&builder));
-			return NULL;
-		}
-	}
-
-	g_strfreev (split);
-
-	return g_variant_builder_end (&builder);
-}
-
-static GVariant *
-split_dns_list_to_gvariant (const char *str)
-{
-	GVariant *var = NULL;
-	gchar **split;
-	int i, j;
-
-	if (!str || strlen (str) < 1)
-		return NULL;
-
-	split = g_strsplit_set (str, ", ", -1);
-	if (!split)
-		return NULL;
-
-	/* Eliminate empty strings */
-	for (i = 0, j = 0; split[i]; i++) {
-		if (split[i][0]) {
-			if (j != i) {
-				split[j] = split[i];
-				split[i] = NULL;
-			}
-			j++;
-		} else {
-			g_free(split[i]);
-			split[i] = NULL;
-		}
-	}
-
-	if (j)
-		var = g_variant_new_strv ((const gchar **)split, -1);
-	g_strfreev (split);
-
-	return var;
+	_LOGD ("configuration sent in %" G_GINT64_FORMAT " ms",
+	       (g_get_monotonic_time () - start) / 1000);
 }
 
-static GVariant *
-get_ip4_routes (void)
+/* Hand our environment to nm-openconnect-service, which translates it
+ * and applies the configuration, and return its verdict as exit status. */
+static int
+forward_environment (int fd)
 {
-	GVariantBuilder builder;
-	GVariant *value;
-	char *tmp;
-	int size = 0, num, i;
-
-#define BUFLEN 256
-
-	tmp = getenv ("CISCO_SPLIT_INC");
-	if (!tmp || strlen (tmp) < 1)
-		return NULL;
-
-	num = atoi (tmp);
-	if (!num)
-		return NULL;
-
-	g_variant_builder_init (&builder, G_VARIANT_TYPE ("aau"));
-
-	for (i = 0; i < num; i++) {
-		GVariantBuilder array;
-		char buf[BUFLEN];
-		struct in_addr network;
-		guint32 next_hop = 0; /* no next hop */
-		guint32 prefix, metric = 0;
-
-		snprintf (buf, BUFLEN, "CISCO_SPLIT_INC_%d_ADDR", i);
-		tmp = getenv (buf);
-		if (!tmp || inet_pton (AF_INET, tmp, &network) <= 0) {
-			_LOGW ("Ignoring invalid static route address '%s'", tmp ? tmp : "NULL");
+	GByteArray *msg;
+	char **iter;
+	guint32 len;
+	gsize done = 0;
+	guint8 status = 1;
+	ssize_t n;
+
+	msg = g_byte_array_sized_new (4096);
+	g_byte_array_set_size (msg, sizeof (len));
+	for (iter = environ; iter && *iter; iter++)
+		g_byte_array_append (msg, (const guint8 *) *iter, strlen (*iter) + 1);
+	len = msg->len - sizeof (len);
+	memcpy (msg->data, &len, sizeof (len));
+
+	while (done < msg->len) {
+		n = write (fd, msg->data + done, msg->len - done);
+		if (n < 0 && errno == EINTR)
 			continue;
+		if (n <= 0) {
+			_LOGW ("Could not forward environment: %s", g_strerror (errno));
+			goto out;
 		}
-
-		snprintf (buf, BUFLEN, "CISCO_SPLIT_INC_%d_MASKLEN", i);
-		tmp = getenv (buf);
-		if (tmp) {
-			long int tmp_prefix;
-
-			errno = 0;
-			tmp_prefix = strtol (tmp, NULL, 10);
-			if (errno || tmp_prefix <= 0 || tmp_prefix > 32) {
-				_LOGW ("Ignoring invalid static route prefix '%s'", tmp ? tmp : "NULL");
-				continue;
-			}
-			prefix = (guint32) tmp_prefix;
-		} else {
-			struct in_addr netmask;
-
-			snprintf (buf, BUFLEN, "CISCO_SPLIT_INC_%d_MASK", i);
-			tmp = getenv (buf);
-			if (!tmp || inet_pton (AF_INET, tmp, &netmask) <= 0) {
-				_LOGW ("Ignoring invalid static route netmask '%s'", tmp ? tmp : "NULL");
-				continue;
-			}
-			prefix = nm_utils_ip4_netmask_to_prefix (netmask.s_addr);
-		}
-
-		g_variant_builder_init (&array, G_VARIANT_TYPE ("au"));
-		g_variant_builder_add_value (&array, g_variant_new_uint32 (network.s_addr));
-		g_variant_builder_add_value (&array, g_variant_new_uint32 (prefix));
-		g_variant_builder_add_value (&array, g_variant_new_uint32 (next_hop));
-		g_variant_builder_add_value (&array, g_variant_new_uint32 (metric));
-		g_variant_builder_add_value (&builder, g_variant_builder_end (&array));
-		size++;
+		done += n;
 	}
 
-	value = g_variant_builder_end (&builder);
-	if (size > 0)
-		return value;
-
-	g_variant_unref (value);
-	return NULL;
-}
-
-static GVariant *
-get_ip6_routes (void)
-{
-	GVariant *value = NULL;
-	GPtrArray *routes;
-	char *tmp;
-	int num;
-	int i;
-
-	tmp = getenv ("CISCO_IPV6_SPLIT_INC");
-	if (!tmp || strlen (tmp) < 1)
-		return NULL;
-
-	num = atoi (tmp);
-	if (!num)
-		return NULL;
-
-	routes = g_ptr_array_new_full (num, (GDestroyNotify) nm_ip_route_unref);
-
-	for (i = 0; i < num; i++) {
-		NMIPRoute *route;
-		char buf[BUFLEN];
-		char *network;
-		guint32 prefix;
-		GError *error = NULL;
-
-		snprintf (buf, BUFLEN, "CISCO_IPV6_SPLIT_INC_%d_ADDR", i);
-		network = getenv (buf);
-		if (!network) {
-			_LOGW ("Ignoring invalid static route address '%s'", network ? network : "NULL");
-			continue;
-		}
-
-		snprintf (buf, BUFLEN, "CISCO_IPV6_SPLIT_INC_%d_MASKLEN", i);
-		tmp = getenv (buf);
-		if (tmp) {
-			long int tmp_prefix;
-
-			errno = 0;
-			tmp_prefix = strtol (tmp, NULL, 10);
-			if (errno || tmp_prefix <= 0 || tmp_prefix > 128) {
-				_LOGW ("Ignoring invalid static route prefix '%s'", tmp ? tmp : "NULL");
-				continue;
-			}
-			prefix = (guint32) tmp_prefix;
-		} else {
-			_LOGW ("Ignoring static route %d with no prefix length", i);
-			continue;
-		}
-
-		route = nm_ip_route_new (AF_INET6, network, prefix, NULL, -1, &error);
-		if (!route) {
-			_LOGW ("Ignoring a route: %s", error->message);
-			g_error_free (error);
-			continue;
-		}
-
-		g_ptr_array_add (routes, route);
+	do
+		n = read (fd, &status, 1);
+	while (n < 0 && errno == EINTR);
+	if (n != 1) {
+		_LOGW ("No reply from nm-openconnect-service");
+		status = 1;
 	}
 
-	if (routes->len)
-		value = nm_utils_ip6_routes_to_variant (routes);
-	g_ptr_array_unref (routes);
-
-	return value;
+out:
+	g_byte_array_unref (msg);
+	close (fd);
+	return status;
 }
 
-/*
- * Environment variables passed back from 'openconnect':
- *
- * VPNGATEWAY             -- vpn gateway address (always present)
- * TUNDEV                 -- tunnel device (always present)
- * INTERNAL_IP4_ADDRESS   -- address (always present)
- * INTERNAL_IP4_NETMASK   -- netmask (often unset)
- * INTERNAL_IP4_DNS       -- list of dns serverss
- * INTERNAL_IP4_NBNS      -- list of wins servers
- * CISCO_DEF_DOMAIN       -- default domain name
- * CISCO_SPLIT_DNS        -- default domain name
- * CISCO_BANNER           -- banner from server
- *
- */
 int
 main (int argc, char *argv[])
 {
-	GDBusProxy *proxy;
+	GDBusConnection *connection;
 	char *tmp;
-	GVariantBuilder builder, ip4builder, ip6builder;
-	GVariant *ip4config, *ip6config;
-	GVariant *val;
+	GVariant *config, *ip4config, *ip6config;
 	GError *err = NULL;
-	struct in_addr temp_addr;
-	char *bus_path;
-	gboolean has_ip4 = FALSE, has_ip6 = FALSE;
+	const char *failure;
+	gint64 helper_fd;
 
 #if !GLIB_CHECK_VERSION (2, 35, 0)
 	g_type_init ();
@@ -460,6 +245,9 @@ main (int argc, char *argv[])
 	                                             10, 0, LOG_DEBUG,
 	                                             LOG_NOTICE);
 	gl.log_prefix_token = getenv ("NM_VPN_LOG_PREFIX_TOKEN") ?: "???";
+	gl.dbus_timeout = _nm_utils_ascii_str_to_int64 (getenv (NM_OPENCONNECT_HELPER_TIMEOUT_ENV),
+	                                                10, 1, G_MAXINT,
+	                                                NM_OPENCONNECT_HELPER_TIMEOUT_DEFAULT);
 
 	if (_LOGD_enabled ()) {
 		GString *args;
@@ -482,6 +270,13 @@ main (int argc, char *argv[])
 			_LOGD ("environment: %s", *iter);
 	}
 
+	/* Started by nm-openconnect-service with a channel back to it; the
+	 * service handles every "reason" openconnect gives us. */
+	helper_fd = _nm_utils_ascii_str_to_int64 (getenv (NM_OPENCONNECT_HELPER_FD_ENV),
+	                                          10, 0, G_MAXINT, -1);
+	if (helper_fd >= 0)
+		exit (forward_environment (helper_fd));
+
 	/* openconnect gives us a "reason" code.  If we are given one,
 	 * don't proceed unless its "connect".
 	 */
@@ -489,210 +284,33 @@ main (int argc, char *argv[])
 	if (tmp && strcmp (tmp, "connect") != 0)
 		exit (0);
 
-	bus_path = getenv ("NM_DBUS_SERVICE_OPENCONNECT");
-	if (!bus_path)
-		bus_path = NM_DBUS_SERVICE_OPENCONNECT;
-
-	proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
-	                                       G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-	                                       NULL,
-	                                       bus_path,
-	                                       NM_VPN_DBUS_PLUGIN_PATH,
-	                                       NM_VPN_DBUS_PLUGIN_INTERFACE,
-	                                       NULL, &err);
-	if (!proxy) {
-		_LOGW ("Could not create a D-Bus proxy: %s", err->message);
+	gl.bus_name = getenv ("NM_DBUS_SERVICE_OPENCONNECT");
+	if (!gl.bus_name)
+		gl.bus_name = NM_DBUS_SERVICE_OPENCONNECT;
+
+	/* Plain method calls; no need for a proxy and its setup */
+	connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &err);
+	if (!connection) {
+		_LOGW ("Could not connect to the system bus: %s", err->message);
 		g_error_free (err);
 		exit (1);
 	}
+	g_dbus_connection_set_exit_on_close (connection, FALSE);
 
-	g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
-	g_variant_builder_init (&ip4builder, G_VARIANT_TYPE_VARDICT);
-	g_variant_builder_init (&ip6builder, G_VARIANT_TYPE_VARDICT);
-
-	/* Gateway */
-	val = addr4_to_gvariant (getenv ("VPNGATEWAY"));
-	if (!val)
-		val = addr6_to_gvariant (getenv ("VPNGATEWAY"));
-	if (val)
-		g_variant_builder_add (&builder, "{sv}", NM_VPN_PLUGIN_CONFIG_EXT_GATEWAY, val);
-	else
-		helper_failed (proxy, "VPN Gateway");
-
-	/* Tunnel device */
-	val = str_to_gvariant (getenv ("TUNDEV"), FALSE);
-	if (val)
-		g_variant_builder_add (&builder, "{sv}", NM_VPN_PLUGIN_CONFIG_TUNDEV, val);
-	else
-		helper_failed (proxy, "Tunnel Device");
-
-	/* Banner */
-	val = str_to_gvariant (getenv ("CISCO_BANNER"), TRUE);
-	if (val)
-		g_variant_builder_add (&builder, "{sv}", NM_VPN_PLUGIN_CONFIG_BANNER, val);
-
-	/* Proxy */
-	val = str_to_gvariant (getenv ("CISCO_PROXY_PAC"), TRUE);
-	if (val)
-		g_variant_builder_add (&builder, "{sv}", NM_VPN_PLUGIN_CONFIG_PROXY_PAC, val);
-
-	/* MTU  */
-	tmp = getenv ("INTERNAL_IP4_MTU");
-	if (tmp && strlen (tmp)) {
-		long int mtu;
-
-		errno = 0;
-		mtu = strtol (tmp, NULL, 10);
-		if (errno || mtu < 0 || mtu > 20000) {
-			_LOGW ("Ignoring invalid tunnel MTU '%s'", tmp);
-		} else {
-			val = g_variant_new_uint32 ((guint32) mtu);
-			g_variant_builder_add (&builder, "{sv}", NM_VPN_PLUGIN_CONFIG_MTU, val);
-		}
-	}
-
-	/* IPv4 address */
-	tmp = getenv ("INTERNAL_IP4_ADDRESS");
-	if (tmp && strlen (tmp)) {
-		val = addr4_to_gvariant (tmp);
-		if (val)
-			g_variant_builder_add (&ip4builder, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_ADDRESS, val);
-		else
-			helper_failed (proxy, "IP4 Address");
-		has_ip4 = TRUE;
-	}
-
-	/* IPv4 PTP address; for openconnect PTP address == internal IPv4 address */
-	tmp = getenv ("INTERNAL_IP4_ADDRESS");
-	if (tmp && strlen (tmp)) {
-		val = addr4_to_gvariant (tmp);
-		if (val)
-			g_variant_builder_add (&ip4builder, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_PTP, val);
-		else
-			helper_failed (proxy, "IP4 Address");
-	}
-
-	/* IPv4 Netmask */
-	tmp = getenv ("INTERNAL_IP4_NETMASK");
-	if (tmp && inet_pton (AF_INET, tmp, &temp_addr) > 0) {
-		val = g_variant_new_uint32 (nm_utils_ip4_netmask_to_prefix (temp_addr.s_addr));
-		g_variant_builder_add (&ip4builder, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_PREFIX, val);
-	}
-
-	/* DNS */
-	val = addr4_list_to_gvariant (getenv ("INTERNAL_IP4_DNS"));
-	if (val)
-		g_variant_builder_add (&ip4builder, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_DNS, val);
-
-	/* WINS servers */
-	val = addr4_list_to_gvariant (getenv ("INTERNAL_IP4_NBNS"));
-	if (val)
-		g_variant_builder_add (&ip4builder, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_NBNS, val);
-
-	/* We have two environment variables with domains --
-	   CISCO_SPLIT_DNS and CISCO_DEF_DOMAIN. On Cisco,
-	   CISCO_DEF_DOMAIN can only be a single domain, while
-	   CISCO_SPLIT_DNS can have multiple domains separated by
-	   comma. On Juniper, CISCO_SPLIT_DNS is not supported but
-	   CISCO_DEF_DOMAIN can have multiple domains separated by ", ".
-
-	   The upshot of all this is we use CISCO_SPLIT_DNS if available,
-	   CISCO_DEF_DOMAIN if not. */
-
-	val = split_dns_list_to_gvariant (getenv ("CISCO_SPLIT_DNS"));
-	if (val) {
-		g_variant_builder_add (&ip4builder, "{sv}",
-				       NM_VPN_PLUGIN_IP4_CONFIG_DOMAINS, val);
-	} else {
-		val = split_dns_list_to_gvariant (getenv ("CISCO_DEF_DOMAIN"));
-		if (val) {
-			g_variant_builder_add (&ip4builder, "{sv}",
-					       NM_VPN_PLUGIN_IP4_CONFIG_DOMAINS, val);
-		}
-	}
-
-	/* Routes */
-	val = get_ip4_routes ();
-	if (val) {
-		g_variant_builder_add (&ip4builder, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_ROUTES, val);
-		/* If routes-to-include were provided, that means no default route */
-		g_variant_builder_add (&ip4builder, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_NEVER_DEFAULT,
-		                       g_variant_new_boolean (TRUE));
-	}
-
-	/* Default domain */
-	val = str_to_gvariant (getenv ("CISCO_DEF_DOMAIN"), TRUE);
-	if (val)
-		g_variant_builder_add (&ip6builder, "{sv}", NM_VPN_PLUGIN_IP6_CONFIG_DOMAIN, val);
-
-	/* IPv6 address */
-	tmp = getenv ("INTERNAL_IP6_ADDRESS");
-	if (tmp && strlen (tmp)) {
-		val = addr6_to_gvariant (tmp);
-		if (val)
-			g_variant_builder_add (&ip6builder, "{sv}", NM_VPN_PLUGIN_IP6_CONFIG_ADDRESS, val);
-		else
-			helper_failed (proxy, "IP6 Address");
-		has_ip6 = TRUE;
-	}
-
-	/* IPv6 PTP address; for openconnect PTP address == internal IPv6 address */
-	tmp = getenv ("INTERNAL_IP6_ADDRESS");
-	if (tmp && strlen (tmp)) {
-		val = addr6_to_gvariant (tmp);
-		if (val)
-			g_variant_builder_add (&ip6builder, "{sv}", NM_VPN_PLUGIN_IP6_CONFIG_PTP, val);
-		else
-			helper_failed (proxy, "IP6 PTP Address");
-	}
+	if (!nm_openconnect_config_from_env ((const char *const *) environ,
+	                                     &config, &ip4config, &ip6config,
+	                                     &failure))
+		helper_failed (connection, failure);
 
-	/* IPv6 Netmask */
-	tmp = getenv ("INTERNAL_IP6_NETMASK");
-	if (tmp)
-		tmp = strchr (tmp, '/');
-	if (tmp) {
-		val = g_variant_new_uint32 (strtol (tmp + 1, NULL, 10));
-		g_variant_builder_add (&ip6builder, "{sv}", NM_VPN_PLUGIN_IP6_CONFIG_PREFIX, val);
-	}
-
-	/* DNS */
-	val = addr6_list_to_gvariant (getenv ("INTERNAL_IP6_DNS"));
-	if (val)
-		g_variant_builder_add (&ip6builder, "{sv}", NM_VPN_PLUGIN_IP6_CONFIG_DNS, val);
-
-	/* Routes */
-	val = get_ip6_routes ();
-	if (val) {
-		g_variant_builder_add (&ip6builder, "{sv}", NM_VPN_PLUGIN_IP6_CONFIG_ROUTES, val);
-		/* If routes-to-include were provided, that means no default route */
-		g_variant_builder_add (&ip6builder, "{sv}", NM_VPN_PLUGIN_IP6_CONFIG_NEVER_DEFAULT,
-		                       g_variant_new_boolean (TRUE));
-	}
-
-	ip4config = g_variant_builder_end (&ip4builder);
+	/* Send the config info to nm-openconnect-service */
+	send_config (connection, config, ip4config, ip6config);
 
-	if (has_ip4) {
-		val = g_variant_new_boolean (TRUE);
-		g_variant_builder_add (&builder, "{sv}", NM_VPN_PLUGIN_CONFIG_HAS_IP4, val);
-	} else {
+	g_variant_unref (config);
+	if (ip4config)
 		g_variant_unref (ip4config);
-		ip4config = NULL;
-	}
-
-	ip6config = g_variant_builder_end (&ip6builder);
-
-	if (has_ip6) {
-		val = g_variant_new_boolean (TRUE);
-		g_variant_builder_add (&builder, "{sv}", NM_VPN_PLUGIN_CONFIG_HAS_IP6, val);
-	} else {
+	if (ip6config)
 		g_variant_unref (ip6config);
-		ip6config = NULL;
-	}
-
-	/* Send the config info to nm-openconnect-service */
-	send_config (proxy, g_variant_builder_end (&builder), ip4config, ip6config);
-
-	g_object_unref (proxy);
+	g_object_unref (connection);
 
 	exit (0);
 }
@@ -38,22 +38,97 @@
 #include <sys/ioctl.h>
 #include <linux/if_tun.h>
 #include <net/if.h>
+#include <netinet/in.h>
+#include <ifaddrs.h>
 #include <pwd.h>
 #include <grp.h>
 #include <locale.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <glib-unix.h>
 
 #include "nm-utils/nm-shared-utils.h"
 #include "nm-utils/nm-vpn-plugin-macros.h"
 
+#include "nm-openconnect-config.h"
+
 #if !defined(DIST_VERSION)
 # define DIST_VERSION VERSION
 #endif
 
 G_DEFINE_TYPE (NMOpenconnectPlugin, nm_openconnect_plugin, NM_TYPE_VPN_SERVICE_PLUGIN)
 
+typedef enum {
+	OC_TUNNEL_STATE_STARTING,
+	OC_TUNNEL_STATE_RUNNING,
+	OC_TUNNEL_STATE_RECONNECTING,
+	OC_TUNNEL_STATE_STOPPING,
+	OC_TUNNEL_STATE_FAILED,
+} OpenconnectTunnelState;
+
+typedef enum {
+	OC_CONNECT_STAGE_BINARY,
+	OC_CONNECT_STAGE_TUNDEV,
+	OC_CONNECT_STAGE_SPAWN,
+	OC_CONNECT_STAGE_COOKIE,
+} OpenconnectConnectStage;
+
+typedef struct _LauncherExec LauncherExec;
+
+/* One openconnect child and the resources it holds */
 typedef struct {
+	NMOpenconnectPlugin *plugin;
+	char *uuid;
 	GPid pid;
 	char *tun_name;
+	guint watch_id;
+	OpenconnectTunnelState state;
+
+	/* Process handle, if the kernel has pidfds, and stopping */
+	int pidfd;
+	guint pidfd_watch_id;
+	guint kill_id;
+	gint64 stop_start;
+
+	/* Connect in progress */
+	NMConnection *connection;
+	guint connect_id;
+	OpenconnectConnectStage connect_stage;
+	gint64 connect_start;
+	GPtrArray *argv;
+	GCancellable *probe_cancellable;
+	GCancellable *tun_cancellable;
+	LauncherExec *launch;
+	int cookie_fd;
+	char *cookie;
+	gsize cookie_len;
+	gsize cookie_written;
+	guint cookie_watch_id;
+	guint cookie_timeout_id;
+
+	/* Channel to the helper openconnect runs as its script */
+	int helper_fd;
+	int helper_child_fd;
+	guint helper_watch_id;
+	GByteArray *helper_buf;
+
+	/* What NetworkManager was last given */
+	GVariant *last_config;
+	GVariant *last_ip4config;
+	GVariant *last_ip6config;
+
+	gint64 reconnect_start;
+} OpenconnectTunnel;
+
+/* libnm only takes a Connect while the plugin is stopped, and stopping
+ * takes every tunnel out of @tunnels, so it holds one tunnel at most.
+ * Tunnels whose openconnect was told to exit, or killed after a failed
+ * connect, wait for it in @stopping; they no longer count for the
+ * connection, which may already be up again by the time they are gone. */
+typedef struct {
+	GHashTable *tunnels; /* connection UUID -> OpenconnectTunnel */
+	GSList *stopping;
 } NMOpenconnectPluginPrivate;
 
 #define NM_OPENCONNECT_PLUGIN_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), NM_TYPE_OPENCONNECT_PLUGIN, NMOpenconnectPluginPrivate))
@@ -71,6 +146,25 @@ static const char *openconnect_binary_paths[] =
 
 #define NM_OPENCONNECT_HELPER_PATH LIBEXECDIR"/nm-openconnect-service-openconnect-helper"
 
+/* Number of idle persistent tun devices kept ready for the next connect */
+#define NM_OPENCONNECT_TUN_POOL_SIZE 1
+
+/* IPv4 addresses removed from a used tun device before giving up on it */
+#define NM_OPENCONNECT_TUN_MAX_ADDRS 16
+
+/* Tries for a tun ioctl sequence, and microseconds of backoff per retry */
+#define NM_OPENCONNECT_TUN_ATTEMPTS 3
+#define NM_OPENCONNECT_TUN_RETRY_DELAY 50000
+
+/* Seconds openconnect gets to read the cookie from its stdin */
+#define NM_OPENCONNECT_COOKIE_TIMEOUT 10
+
+/* How long the pre-forked launcher gets to exec openconnect (ms) */
+#define NM_OPENCONNECT_LAUNCHER_TIMEOUT 2000
+
+/* Default milliseconds openconnect gets to exit after SIGTERM */
+#define NM_OPENCONNECT_STOP_TIMEOUT 2000
+
 typedef struct {
 	const char *name;
 	GType type;
@@ -92,6 +186,8 @@ static const ValidProperty valid_properties[] = {
 	{ NM_OPENCONNECT_KEY_CSD_WRAPPER, G_TYPE_STRING, 0, 0 },
 	{ NM_OPENCONNECT_KEY_TOKEN_MODE,  G_TYPE_STRING, 0, 0 },
 	{ NM_OPENCONNECT_KEY_TOKEN_SECRET, G_TYPE_STRING, 0, 0 },
+	{ NM_OPENCONNECT_KEY_PROBE_GATEWAYS, G_TYPE_BOOLEAN, 0, 0 },
+	{ NM_OPENCONNECT_KEY_HEADLESS,    G_TYPE_BOOLEAN, 0, 0 },
 	{ NULL,                           G_TYPE_NONE, 0, 0 }
 };
 
@@ -102,6 +198,20 @@ static const ValidProperty valid_secrets[] = {
 	{ NULL,                       G_TYPE_NONE, 0, 0 }
 };
 
+typedef enum {
+	OC_CAP_PROTOCOL        = (1 << 0),
+	OC_CAP_JUNIPER         = (1 << 1),
+} OpenconnectCaps;
+
+typedef struct {
+	char *path;
+	guint64 inode;
+	gint64 mtime;
+	gboolean probed;
+	char *version;
+	OpenconnectCaps caps;
+} OpenconnectBinary;
+
 typedef struct ValidateInfo {
 	const ValidProperty *table;
 	GError **error;
@@ -111,9 +221,33 @@ typedef struct ValidateInfo {
 static struct {
 	uid_t tun_owner;
 	gid_t tun_group;
+	gboolean have_tun_owner;
+	gboolean no_tundev;
 	gboolean debug;
+	gboolean persist;
 	int log_level;
 	GMainLoop *loop;
+	GQueue tun_pool;
+	guint tun_pool_refill_id;
+	gboolean tun_pool_refilling;
+	gboolean tun_pool_closed;
+	guint tun_tasks;
+	GMutex tun_lock;
+	guint32 *tun_slots;
+	guint tun_slots_n_words;
+	OpenconnectBinary *binary;
+	gboolean prefork;
+	GPid launcher_pid;
+	int launcher_fd;
+	guint launcher_spawn_id;
+	int stop_timeout;
+	char *openconnect_path;
+	char *helper_path;
+	struct {
+		const char *phase;
+		gint64 time;
+	} startup[8];
+	guint startup_n;
 } gl/*obal*/;
 
 /*****************************************************************************/
@@ -245,99 +379,1708 @@ nm_openconnect_secrets_validate (NMSettingVpn *s_vpn, GError **error)
 	return *error ? FALSE : TRUE;
 }
 
-static char *
-create_persistent_tundev(void)
+/* Bitmap of vpnN slots which are known to be taken, either by one of
+ * our own devices or by somebody else. It only serves as a hint for
+ * picking a candidate name; the kernel has the final word. The worker
+ * threads creating and removing devices update it under gl.tun_lock. */
+
+static guint
+tun_slot_find_free (void)
+{
+	guint i;
+
+	for (i = 0; i < gl.tun_slots_n_words; i++) {
+		if (gl.tun_slots[i] != G_MAXUINT32)
+			return i * 32 + g_bit_nth_lsf (~gl.tun_slots[i], -1);
+	}
+	return i * 32;
+}
+
+static void
+tun_slot_set (guint slot, gboolean taken)
+{
+	guint word = slot / 32;
+
+	if (word >= gl.tun_slots_n_words) {
+		if (!taken)
+			return;
+		gl.tun_slots = g_renew (guint32, gl.tun_slots, word + 1);
+		memset (&gl.tun_slots[gl.tun_slots_n_words], 0,
+		        (word + 1 - gl.tun_slots_n_words) * sizeof (guint32));
+		gl.tun_slots_n_words = word + 1;
+	}
+
+	if (taken)
+		gl.tun_slots[word] |= (1u << (slot % 32));
+	else
+		gl.tun_slots[word] &= ~(1u << (slot % 32));
+}
+
+static gboolean
+tun_name_to_slot (const char *tun_name, guint *out_slot)
+{
+	gint64 slot;
+
+	if (!g_str_has_prefix (tun_name, "vpn"))
+		return FALSE;
+
+	slot = _nm_utils_ascii_str_to_int64 (tun_name + 3, 10, 0, G_MAXINT32, -1);
+	if (slot < 0)
+		return FALSE;
+
+	*out_slot = slot;
+	return TRUE;
+}
+
+/* Called once from main(), before any worker thread that reads the
+ * owner is started */
+static gboolean
+tun_owner_lookup (void)
 {
 	struct passwd *pw;
-	struct ifreq ifr;
-	int fd;
-	int i;
 
 	pw = getpwnam(NM_OPENCONNECT_USER);
 	if (!pw)
-		return NULL;
+		return FALSE;
 
 	gl.tun_owner = pw->pw_uid;
 	gl.tun_group = pw->pw_gid;
+	return TRUE;
+}
+
+/* Loads the tun module, once. Normally opening /dev/net/tun autoloads
+ * it, so this only matters on systems without the device node. */
+static void
+tun_module_load (void)
+{
+	static gsize loaded = 0;
+	const char *argv[] = { "/sbin/modprobe", "tun", NULL };
+	GError *error = NULL;
+	int status;
+
+	if (!g_once_init_enter (&loaded))
+		return;
+
+	if (!g_spawn_sync (NULL, (char **) argv, NULL,
+	                   G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+	                   NULL, NULL, NULL, NULL, &status, &error)) {
+		_LOGW ("Could not run modprobe: %s", error->message);
+		g_error_free (error);
+	} else if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+		_LOGW ("modprobe tun failed");
+
+	g_once_init_leave (&loaded, 1);
+}
+
+static int
+tun_open (void)
+{
+	int fd;
+
+	fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+	if (fd < 0 && (errno == ENOENT || errno == ENODEV)) {
+		tun_module_load ();
+		fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+	}
+	return fd;
+}
+
+/* Runs in a worker thread */
+static char *
+create_persistent_tundev(GError **error)
+{
+	struct ifreq ifr;
+	int fd;
+	int errsv;
+	guint slot;
+	gboolean have_slot;
 
-	fd = open("/dev/net/tun", O_RDWR);
+	fd = tun_open ();
 	if (fd < 0) {
-		perror("open /dev/net/tun");
-		exit(EXIT_FAILURE);
+		errsv = errno;
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+		             _("Could not open /dev/net/tun: %s"),
+		             g_strerror (errsv));
+		return NULL;
 	}
 
+	/* Try the first slot not known to be taken. IFF_TUN_EXCL makes sure
+	 * we never attach to an existing device of another instance. */
+	g_mutex_lock (&gl.tun_lock);
+	slot = tun_slot_find_free ();
+	g_mutex_unlock (&gl.tun_lock);
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_TUN_EXCL;
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "vpn%u", slot);
 
-	for (i = 0; i < 256; i++) {
-		sprintf(ifr.ifr_name, "vpn%d", i);
+	if (ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
+		if (errno == EBUSY) {
+			g_mutex_lock (&gl.tun_lock);
+			tun_slot_set (slot, TRUE);
+			g_mutex_unlock (&gl.tun_lock);
+		}
 
-		if (!ioctl(fd, TUNSETIFF, (void *)&ifr))
-			break;
+		/* Let the kernel pick the next free vpnN instead of probing */
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+		strcpy(ifr.ifr_name, "vpn%d");
+
+		if (ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
+			errsv = errno;
+			close(fd);
+			g_set_error (error,
+			             NM_VPN_PLUGIN_ERROR,
+			             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+			             _("Could not allocate a tun device: %s"),
+			             g_strerror (errsv));
+			return NULL;
+		}
 	}
-	if (i == 256)
-		exit(EXIT_FAILURE);
 
-	if (ioctl(fd, TUNSETOWNER, gl.tun_owner) < 0) {
-		perror("TUNSETOWNER");
-		exit(EXIT_FAILURE);
+	have_slot = tun_name_to_slot (ifr.ifr_name, &slot);
+	if (have_slot) {
+		g_mutex_lock (&gl.tun_lock);
+		tun_slot_set (slot, TRUE);
+		g_mutex_unlock (&gl.tun_lock);
 	}
 
-	if (ioctl(fd, TUNSETPERSIST, 1)) {
-		perror("TUNSETPERSIST");
-		exit(EXIT_FAILURE);
+	if (   ioctl(fd, TUNSETOWNER, gl.tun_owner) < 0
+	    || ioctl(fd, TUNSETPERSIST, 1) < 0) {
+		errsv = errno;
+		/* The device is not persistent yet, so closing removes it */
+		close(fd);
+		if (have_slot) {
+			g_mutex_lock (&gl.tun_lock);
+			tun_slot_set (slot, FALSE);
+			g_mutex_unlock (&gl.tun_lock);
+		}
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+		             _("Could not set up tun device %s: %s"),
+		             ifr.ifr_name, g_strerror (errsv));
+		return NULL;
 	}
 	close(fd);
-	_LOGW ("Created tundev %s\n", ifr.ifr_name);
+	_LOGD ("Created tundev %s", ifr.ifr_name);
 	return g_strdup(ifr.ifr_name);
 }
 
-static void
-destroy_persistent_tundev(char *tun_name)
+/* Runs in a worker thread */
+static gboolean
+destroy_persistent_tundev(const char *tun_name, GError **error)
 {
 	struct ifreq ifr;
 	int fd;
+	int errsv;
+	guint slot;
 
-	fd = open("/dev/net/tun", O_RDWR);
+	fd = tun_open ();
 	if (fd < 0) {
-		perror("open /dev/net/tun");
-		exit(EXIT_FAILURE);
+		errsv = errno;
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_GENERAL,
+		             _("Could not open /dev/net/tun: %s"),
+		             g_strerror (errsv));
+		return FALSE;
 	}
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-	strcpy(ifr.ifr_name, tun_name);
+	g_strlcpy(ifr.ifr_name, tun_name, sizeof(ifr.ifr_name));
 
-	if (ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
-		perror("TUNSETIFF");
-		exit(EXIT_FAILURE);
+	if (   ioctl(fd, TUNSETIFF, (void *)&ifr) < 0
+	    || ioctl(fd, TUNSETPERSIST, 0) < 0) {
+		errsv = errno;
+		close(fd);
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_GENERAL,
+		             _("Could not remove tun device %s: %s"),
+		             tun_name, g_strerror (errsv));
+		return FALSE;
+	}
+	_LOGD ("Destroyed tundev %s", tun_name);
+	close(fd);
+
+	if (tun_name_to_slot (tun_name, &slot)) {
+		g_mutex_lock (&gl.tun_lock);
+		tun_slot_set (slot, FALSE);
+		g_mutex_unlock (&gl.tun_lock);
+	}
+	return TRUE;
+}
+
+static gboolean
+tundev_has_addresses (const char *tun_name)
+{
+	struct ifaddrs *ifaddrs, *ifa;
+	gboolean found = FALSE;
+
+	if (getifaddrs (&ifaddrs) < 0)
+		return TRUE;
+
+	for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+		if (   ifa->ifa_addr
+		    && (ifa->ifa_addr->sa_family == AF_INET || ifa->ifa_addr->sa_family == AF_INET6)
+		    && !strcmp (ifa->ifa_name, tun_name))
+			found = TRUE;
+	}
+	freeifaddrs (ifaddrs);
+	return found;
+}
+
+/* Runs in a worker thread. Puts a device openconnect is done with back
+ * the way create_persistent_tundev() left it: owned by our user, down,
+ * and without addresses. Fails if that can't be made sure of, in which
+ * case the device is not to be reused. */
+static gboolean
+reset_persistent_tundev(const char *tun_name, GError **error)
+{
+	struct ifreq ifr;
+	struct sockaddr_in *sin;
+	int fd;
+	int errsv;
+	int i;
+
+	fd = tun_open ();
+	if (fd < 0) {
+		errsv = errno;
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_GENERAL,
+		             _("Could not open /dev/net/tun: %s"),
+		             g_strerror (errsv));
+		return FALSE;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	g_strlcpy(ifr.ifr_name, tun_name, sizeof(ifr.ifr_name));
+
+	if (   ioctl(fd, TUNSETIFF, (void *)&ifr) < 0
+	    || ioctl(fd, TUNSETOWNER, gl.tun_owner) < 0) {
+		errsv = errno;
+		close(fd);
+		goto fail;
+	}
+	close(fd);
+
+	fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		errsv = errno;
+		goto fail;
+	}
+
+	/* Taking the link down drops its routes, and its IPv6 addresses
+	 * unless the system is set up to keep them */
+	memset(&ifr, 0, sizeof(ifr));
+	g_strlcpy(ifr.ifr_name, tun_name, sizeof(ifr.ifr_name));
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr) < 0) {
+		errsv = errno;
+		close(fd);
+		goto fail;
+	}
+	if (ifr.ifr_flags & IFF_UP) {
+		ifr.ifr_flags &= ~IFF_UP;
+		if (ioctl(fd, SIOCSIFFLAGS, &ifr) < 0) {
+			errsv = errno;
+			close(fd);
+			goto fail;
+		}
 	}
 
-	if (ioctl(fd, TUNSETPERSIST, 0)) {
-		perror("TUNSETPERSIST");
-		exit(EXIT_FAILURE);
+	/* Setting 0.0.0.0 removes the primary IPv4 address, and secondary
+	 * ones unless one of them gets promoted; repeat until none is left */
+	for (i = 0; i < NM_OPENCONNECT_TUN_MAX_ADDRS; i++) {
+		memset(&ifr, 0, sizeof(ifr));
+		g_strlcpy(ifr.ifr_name, tun_name, sizeof(ifr.ifr_name));
+		if (ioctl(fd, SIOCGIFADDR, &ifr) < 0)
+			break;
+		sin = (struct sockaddr_in *) &ifr.ifr_addr;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl (INADDR_ANY);
+		if (ioctl(fd, SIOCSIFADDR, &ifr) < 0)
+			break;
 	}
-	_LOGW ("Destroyed  tundev %s\n", tun_name);
 	close(fd);
+
+	if (tundev_has_addresses (tun_name)) {
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_GENERAL,
+		             _("Could not reset tun device %s: addresses are left on it"),
+		             tun_name);
+		return FALSE;
+	}
+	return TRUE;
+
+fail:
+	g_set_error (error,
+	             NM_VPN_PLUGIN_ERROR,
+	             NM_VPN_PLUGIN_ERROR_GENERAL,
+	             _("Could not reset tun device %s: %s"),
+	             tun_name, g_strerror (errsv));
+	return FALSE;
 }
 
-static void openconnect_drop_child_privs(gpointer user_data)
+/*****************************************************************************/
+
+/* The tun ioctls can stall under load, so they run in GTask worker
+ * threads and are retried a few times before giving up. gl.tun_lock
+ * protects the slot bitmap they share. gl.tun_tasks counts the ones in
+ * flight, so shutdown can wait for them. */
+
+static void
+tun_create_thread (GTask *task, gpointer source_object,
+                   gpointer task_data, GCancellable *cancellable)
+{
+	GError *error = NULL;
+	char *tun_name;
+	guint attempt;
+
+	for (attempt = 1; ; attempt++) {
+		tun_name = create_persistent_tundev (&error);
+		if (tun_name || attempt >= NM_OPENCONNECT_TUN_ATTEMPTS)
+			break;
+		_LOGD ("Retrying tun device creation: %s", error->message);
+		g_clear_error (&error);
+		g_usleep (attempt * NM_OPENCONNECT_TUN_RETRY_DELAY);
+	}
+
+	if (tun_name)
+		g_task_return_pointer (task, tun_name, g_free);
+	else
+		g_task_return_error (task, error);
+}
+
+static void
+tun_destroy_thread (GTask *task, gpointer source_object,
+                    gpointer task_data, GCancellable *cancellable)
+{
+	GError *error = NULL;
+	guint attempt;
+
+	for (attempt = 1; ; attempt++) {
+		if (destroy_persistent_tundev (task_data, &error)) {
+			g_task_return_boolean (task, TRUE);
+			return;
+		}
+		if (attempt >= NM_OPENCONNECT_TUN_ATTEMPTS)
+			break;
+		_LOGD ("Retrying tun device removal: %s", error->message);
+		g_clear_error (&error);
+		g_usleep (attempt * NM_OPENCONNECT_TUN_RETRY_DELAY);
+	}
+	g_task_return_error (task, error);
+}
+
+static void
+tun_reset_thread (GTask *task, gpointer source_object,
+                  gpointer task_data, GCancellable *cancellable)
+{
+	GError *error = NULL;
+
+	if (reset_persistent_tundev (task_data, &error))
+		g_task_return_boolean (task, TRUE);
+	else
+		g_task_return_error (task, error);
+}
+
+static void
+tun_task_done (void)
+{
+	g_assert (gl.tun_tasks > 0);
+	gl.tun_tasks--;
+}
+
+/* Only to be used with gl.have_tun_owner set. The device is still
+ * returned if @cancellable was cancelled in the meantime, so that it
+ * can go back to the pool. */
+static void
+tun_create_async (GCancellable *cancellable,
+                  GAsyncReadyCallback callback,
+                  gpointer user_data)
+{
+	GTask *task;
+
+	task = g_task_new (NULL, cancellable, callback, user_data);
+	g_task_set_check_cancellable (task, FALSE);
+	gl.tun_tasks++;
+	g_task_run_in_thread (task, tun_create_thread);
+	g_object_unref (task);
+}
+
+static char *
+tun_create_finish (GAsyncResult *result, GError **error)
+{
+	tun_task_done ();
+	return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+tun_destroy_cb (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	GError *error = NULL;
+
+	tun_task_done ();
+	if (!g_task_propagate_boolean (G_TASK (result), &error)) {
+		_LOGW ("%s", error->message);
+		g_error_free (error);
+	}
+}
+
+/* Takes @tun_name */
+static void
+tun_destroy_async (char *tun_name)
+{
+	GTask *task;
+
+	task = g_task_new (NULL, NULL, tun_destroy_cb, NULL);
+	g_task_set_task_data (task, tun_name, g_free);
+	gl.tun_tasks++;
+	g_task_run_in_thread (task, tun_destroy_thread);
+	g_object_unref (task);
+}
+
+/*****************************************************************************/
+
+/* Creating a persistent tun device means probing for a free vpnN name,
+ * which gets slower the more interfaces exist. So one device is created
+ * in the background while the service waits for its connect, which then
+ * only has to take it from the pool. NetworkManager starts a service per
+ * activation, so that is all most services ever need. Only with
+ * --persist, where one service serves connect after connect, is the pool
+ * topped up again, and are devices handed back when openconnect exits.
+ * A device coming back is reset first, so that nothing of the last
+ * tunnel carries over. */
+
+static void tun_pool_schedule_refill (void);
+
+/* Takes @tun_name, a device ready for use */
+static void
+tun_pool_put (char *tun_name)
+{
+	if (gl.tun_pool_closed || g_queue_get_length (&gl.tun_pool) >= NM_OPENCONNECT_TUN_POOL_SIZE) {
+		tun_destroy_async (tun_name);
+		return;
+	}
+
+	g_queue_push_tail (&gl.tun_pool, tun_name);
+}
+
+static void
+tun_pool_refill_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	GError *error = NULL;
+	char *tun_name;
+
+	gl.tun_pool_refilling = FALSE;
+
+	tun_name = tun_create_finish (result, &error);
+	if (!tun_name) {
+		_LOGW ("Failed to pre-create tun device: %s", error->message);
+		g_error_free (error);
+		return;
+	}
+
+	tun_pool_put (tun_name);
+	tun_pool_schedule_refill ();
+}
+
+static gboolean
+tun_pool_refill_cb (gpointer user_data)
+{
+	gl.tun_pool_refill_id = 0;
+
+	if (   g_queue_get_length (&gl.tun_pool) < NM_OPENCONNECT_TUN_POOL_SIZE
+	    && gl.have_tun_owner) {
+		gl.tun_pool_refilling = TRUE;
+		tun_create_async (NULL, tun_pool_refill_done, NULL);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void
+tun_pool_schedule_refill (void)
+{
+	if (gl.tun_pool_refill_id || gl.tun_pool_refilling || gl.tun_pool_closed)
+		return;
+	if (g_queue_get_length (&gl.tun_pool) >= NM_OPENCONNECT_TUN_POOL_SIZE)
+		return;
+
+	gl.tun_pool_refill_id = g_idle_add_full (G_PRIORITY_LOW, tun_pool_refill_cb, NULL, NULL);
+}
+
+/* Returns a pooled device, or %NULL if the pool is empty */
+static char *
+tun_pool_take (void)
+{
+	char *tun_name;
+
+	tun_name = g_queue_pop_head (&gl.tun_pool);
+	if (tun_name)
+		_LOGD ("Leased tundev %s from pool", tun_name);
+
+	if (gl.persist)
+		tun_pool_schedule_refill ();
+	return tun_name;
+}
+
+static void
+tun_pool_reset_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	char *tun_name = g_strdup (g_task_get_task_data (G_TASK (result)));
+	GError *error = NULL;
+
+	tun_task_done ();
+	if (!g_task_propagate_boolean (G_TASK (result), &error)) {
+		_LOGD ("Not reusing tundev: %s", error->message);
+		g_error_free (error);
+		tun_destroy_async (tun_name);
+		return;
+	}
+
+	_LOGD ("Returned tundev %s to pool", tun_name);
+	tun_pool_put (tun_name);
+}
+
+/* Takes @tun_name, a device openconnect is done with */
+static void
+tun_pool_release (char *tun_name)
 {
-	char *tun_name = user_data;
+	GTask *task;
+
+	if (   !gl.persist
+	    || gl.tun_pool_closed
+	    || g_queue_get_length (&gl.tun_pool) >= NM_OPENCONNECT_TUN_POOL_SIZE) {
+		tun_destroy_async (tun_name);
+		return;
+	}
+
+	task = g_task_new (NULL, NULL, tun_pool_reset_done, NULL);
+	g_task_set_task_data (task, tun_name, g_free);
+	gl.tun_tasks++;
+	g_task_run_in_thread (task, tun_reset_thread);
+	g_object_unref (task);
+}
+
+static void
+tun_pool_drain (void)
+{
+	char *tun_name;
+
+	gl.tun_pool_closed = TRUE;
+	nm_clear_g_source (&gl.tun_pool_refill_id);
+
+	/* Devices still being created land in the pool and get removed, too */
+	for (;;) {
+		while ((tun_name = g_queue_pop_head (&gl.tun_pool)))
+			tun_destroy_async (tun_name);
+		if (!gl.tun_tasks)
+			break;
+		g_main_context_iteration (NULL, TRUE);
+	}
+}
+
+/*****************************************************************************/
+
+/* The openconnect binary is looked up on connect. Its version and
+ * supported options only matter for Juniper, which OpenConnect 7.06
+ * took as --juniper and later versions as --protocol nc; every other
+ * protocol is simply passed with --protocol. Probing means running the
+ * binary twice, so it happens only then, in a worker thread, while the
+ * connect waits. The result is kept on disk across service activations,
+ * keyed by the binary's path, inode and mtime; a package upgrade
+ * replaces the binary and so causes a new probe. */
+
+#define NM_OPENCONNECT_CAPS_CACHE LOCALSTATEDIR"/cache/NetworkManager-openconnect/binary-caps"
+
+static void
+openconnect_binary_free (OpenconnectBinary *binary)
+{
+	g_free (binary->path);
+	g_free (binary->version);
+	g_slice_free (OpenconnectBinary, binary);
+}
+
+static char *
+openconnect_binary_run (const char *path, const char *arg)
+{
+	const char *argv[] = { path, arg, NULL };
+	GError *error = NULL;
+	char *output = NULL;
+
+	if (!g_spawn_sync (NULL, (char **) argv, NULL,
+	                   G_SPAWN_STDERR_TO_DEV_NULL,
+	                   NULL, NULL, &output, NULL, NULL, &error)) {
+		_LOGW ("Failed to run '%s %s': %s", path, arg, error->message);
+		g_error_free (error);
+		return NULL;
+	}
+	return output;
+}
+
+/* Runs in a worker thread. Returns FALSE if the options couldn't be
+ * told, and the result is not worth keeping. */
+static gboolean
+openconnect_binary_probe (OpenconnectBinary *binary)
+{
+	char *output;
+	const char *version;
+
+	output = openconnect_binary_run (binary->path, "--version");
+	if (output) {
+		version = strstr (output, "version ");
+		if (version) {
+			version += NM_STRLEN ("version ");
+			binary->version = g_strndup (version, strcspn (version, "\r\n"));
+		}
+		g_free (output);
+	}
+
+	/* openconnect exits with an error after --help, but the usage text
+	 * on stdout is all we are after */
+	output = openconnect_binary_run (binary->path, "--help");
+	if (!output)
+		return FALSE;
+
+	if (strstr (output, "--protocol"))
+		binary->caps |= OC_CAP_PROTOCOL;
+	if (strstr (output, "--juniper"))
+		binary->caps |= OC_CAP_JUNIPER;
+	g_free (output);
+	return TRUE;
+}
+
+static gboolean
+openconnect_binary_caps_load (OpenconnectBinary *binary)
+{
+	GKeyFile *keyfile = g_key_file_new ();
+	gboolean found = FALSE;
+
+	if (   g_key_file_load_from_file (keyfile, NM_OPENCONNECT_CAPS_CACHE, G_KEY_FILE_NONE, NULL)
+	    && g_key_file_get_uint64 (keyfile, binary->path, "inode", NULL) == binary->inode
+	    && g_key_file_get_int64 (keyfile, binary->path, "mtime", NULL) == binary->mtime
+	    && g_key_file_has_key (keyfile, binary->path, "caps", NULL)) {
+		binary->caps = g_key_file_get_integer (keyfile, binary->path, "caps", NULL);
+		binary->version = g_key_file_get_string (keyfile, binary->path, "version", NULL);
+		found = TRUE;
+	}
+
+	g_key_file_free (keyfile);
+	return found;
+}
+
+static void
+openconnect_binary_caps_store (const OpenconnectBinary *binary)
+{
+	GKeyFile *keyfile = g_key_file_new ();
+	GError *error = NULL;
+	char *dir, *data;
+	gsize len;
+
+	/* One entry per path, so a stale one is simply overwritten */
+	g_key_file_load_from_file (keyfile, NM_OPENCONNECT_CAPS_CACHE, G_KEY_FILE_NONE, NULL);
+	g_key_file_set_uint64 (keyfile, binary->path, "inode", binary->inode);
+	g_key_file_set_int64 (keyfile, binary->path, "mtime", binary->mtime);
+	g_key_file_set_integer (keyfile, binary->path, "caps", binary->caps);
+	if (binary->version)
+		g_key_file_set_string (keyfile, binary->path, "version", binary->version);
+	else
+		g_key_file_remove_key (keyfile, binary->path, "version", NULL);
+
+	dir = g_path_get_dirname (NM_OPENCONNECT_CAPS_CACHE);
+	data = g_key_file_to_data (keyfile, &len, NULL);
+	if (   g_mkdir_with_parents (dir, 0755) < 0
+	    || !g_file_set_contents (NM_OPENCONNECT_CAPS_CACHE, data, len, &error)) {
+		_LOGD ("Could not save openconnect capabilities: %s",
+		       error ? error->message : g_strerror (errno));
+		g_clear_error (&error);
+	}
+
+	g_free (data);
+	g_free (dir);
+	g_key_file_free (keyfile);
+}
+
+static OpenconnectBinary *
+openconnect_binary_get (GError **error)
+{
+	OpenconnectBinary *binary;
+	const char *override_paths[] = { gl.openconnect_path, NULL };
+	const char **path;
+	struct stat st;
+
+	path = gl.openconnect_path ? override_paths : openconnect_binary_paths;
+	for (; *path; path++) {
+		if (stat (*path, &st) == 0)
+			break;
+	}
+
+	if (!*path) {
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+		             "%s",
+		             _("Could not find openconnect binary."));
+		return NULL;
+	}
+
+	if (   gl.binary
+	    && !strcmp (gl.binary->path, *path)
+	    && gl.binary->inode == st.st_ino
+	    && gl.binary->mtime == st.st_mtime)
+		return gl.binary;
+
+	g_clear_pointer (&gl.binary, openconnect_binary_free);
+
+	binary = g_slice_new0 (OpenconnectBinary);
+	binary->path = g_strdup (*path);
+	binary->inode = st.st_ino;
+	binary->mtime = st.st_mtime;
+
+	gl.binary = binary;
+	return binary;
+}
+
+static void
+openconnect_binary_probe_thread (GTask *task, gpointer source_object,
+                                 gpointer task_data, GCancellable *cancellable)
+{
+	OpenconnectBinary *binary = task_data;
+
+	if (   !openconnect_binary_caps_load (binary)
+	    && openconnect_binary_probe (binary))
+		openconnect_binary_caps_store (binary);
+	g_task_return_boolean (task, TRUE);
+}
+
+/* Finds out what @binary supports in a worker thread. The thread works
+ * on a copy, as gl.binary may be replaced before it is done. The result
+ * is still returned if @cancellable was cancelled in the meantime. */
+static void
+openconnect_binary_probe_async (const OpenconnectBinary *binary,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+	OpenconnectBinary *copy;
+	GTask *task;
+
+	copy = g_slice_new0 (OpenconnectBinary);
+	copy->path = g_strdup (binary->path);
+	copy->inode = binary->inode;
+	copy->mtime = binary->mtime;
+
+	task = g_task_new (NULL, cancellable, callback, user_data);
+	g_task_set_check_cancellable (task, FALSE);
+	g_task_set_task_data (task, copy, (GDestroyNotify) openconnect_binary_free);
+	g_task_run_in_thread (task, openconnect_binary_probe_thread);
+	g_object_unref (task);
+}
+
+/* Applies the probe result to gl.binary, unless that is a different
+ * binary by now */
+static void
+openconnect_binary_probe_finish (GAsyncResult *result)
+{
+	const OpenconnectBinary *probed = g_task_get_task_data (G_TASK (result));
+	OpenconnectBinary *binary = gl.binary;
+
+	g_task_propagate_boolean (G_TASK (result), NULL);
+
+	if (   !binary
+	    || binary->probed
+	    || strcmp (binary->path, probed->path)
+	    || binary->inode != probed->inode
+	    || binary->mtime != probed->mtime)
+		return;
+
+	binary->caps = probed->caps;
+	binary->version = g_strdup (probed->version);
+	binary->probed = TRUE;
+
+	_LOGI ("Using openconnect %s at %s (capabilities 0x%x)",
+	       binary->version ?: "(unknown version)", binary->path, binary->caps);
+}
+
+/*****************************************************************************/
+
+static void openconnect_drop_child_privs(gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+
+	/* Let openconnect, and the helper it runs, inherit the channel */
+	if (tunnel->helper_child_fd >= 0)
+		fcntl (tunnel->helper_child_fd, F_SETFD, 0);
+
+	if (tunnel->tun_name) {
+		if (initgroups (NM_OPENCONNECT_USER, gl.tun_group) ||
+		    setgid (gl.tun_group) || setuid (gl.tun_owner)) {
+			_LOGW ("Failed to drop privileges when spawning openconnect");
+			exit (1);
+		}
+	}
+}
+
+/*****************************************************************************/
+
+/* With --prefork, a launcher process is forked ahead of time and has
+ * already dropped its privileges. On connect it receives the cookie
+ * and argv over a socketpair, feeds the cookie to its own stdin and
+ * execs openconnect, so neither the fork nor the privilege drop sits on
+ * the connect path. A replacement is forked from an idle handler.
+ *
+ * Messages are NUL-separated strings: the cookie followed by argv, with
+ * the helper channel attached as SCM_RIGHTS. The launcher acknowledges
+ * receipt with one byte, and reports errno if the exec fails; on success
+ * the close-on-exec socket simply hits EOF. The service waits for that
+ * from the main loop, and spawns openconnect itself if the launcher
+ * fails or doesn't answer in time. */
+
+#define LAUNCHER_MAX_MSG  65536
+#define LAUNCHER_MAX_ARGS 64
+#define LAUNCHER_MAX_ENV  256
+
+extern char **environ;
+
+static gid_t *launcher_groups;
+static int launcher_n_groups;
+
+/* Runs in the forked child: only async-signal-safe calls from here on */
+G_GNUC_NORETURN static void
+launcher_child_main (int fd, pid_t parent, int max_fd)
+{
+	static char msg[LAUNCHER_MAX_MSG];
+	static char *child_argv[LAUNCHER_MAX_ARGS + 1];
+	static char *child_envp[LAUNCHER_MAX_ENV + 2];
+	static char helper_env[NM_STRLEN (NM_OPENCONNECT_HELPER_FD_ENV) + 16] = NM_OPENCONNECT_HELPER_FD_ENV "=";
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (sizeof (int))];
+	} control;
+	struct sigaction action;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	sigset_t mask;
+	int pipe_fds[2];
+	int helper_fd = -1;
+	int argc = 0;
+	int envc = 0;
+	int errsv;
+	ssize_t len;
+	size_t cookie_len;
+	char digits[12];
+	char *p;
+	int i, n;
+
+	for (i = 3; i < max_fd; i++) {
+		if (i != fd)
+			close (i);
+	}
+
+	memset (&action, 0, sizeof (action));
+	action.sa_handler = SIG_DFL;
+	sigaction (SIGTERM, &action, NULL);
+	sigaction (SIGINT, &action, NULL);
+	sigaction (SIGCHLD, &action, NULL);
+	sigemptyset (&mask);
+	sigprocmask (SIG_SETMASK, &mask, NULL);
+
+	if (   setgroups (launcher_n_groups, launcher_groups)
+	    || setgid (gl.tun_group)
+	    || setuid (gl.tun_owner))
+		_exit (1);
+
+	/* Don't outlive the service while waiting. This has to come after
+	 * dropping privileges, as changing credentials clears it. */
+	prctl (PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid () != parent)
+		_exit (0);
+
+	iov.iov_base = msg;
+	iov.iov_len = sizeof (msg) - 1;
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof (control.buf);
+
+	do {
+		len = recvmsg (fd, &mh, 0);
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0)
+		_exit (0);
+
+	if (write (fd, "", 1) != 1)
+		_exit (1);
+
+	for (cmsg = CMSG_FIRSTHDR (&mh); cmsg; cmsg = CMSG_NXTHDR (&mh, cmsg)) {
+		if (   cmsg->cmsg_level == SOL_SOCKET
+		    && cmsg->cmsg_type == SCM_RIGHTS
+		    && cmsg->cmsg_len == CMSG_LEN (sizeof (int)))
+			memcpy (&helper_fd, CMSG_DATA (cmsg), sizeof (int));
+	}
+
+	if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		errsv = E2BIG;
+		goto fail;
+	}
+	msg[len] = '\0';
+
+	cookie_len = strlen (msg);
+	for (p = msg + cookie_len + 1; p < msg + len && argc < LAUNCHER_MAX_ARGS; p += strlen (p) + 1)
+		child_argv[argc++] = p;
+	child_argv[argc] = NULL;
+	if (!argc) {
+		errsv = EINVAL;
+		goto fail;
+	}
+
+	/* The cookie is far smaller than the pipe buffer, so this can't block */
+	if (pipe (pipe_fds)) {
+		errsv = errno;
+		goto fail;
+	}
+	msg[cookie_len] = '\n';
+	if (write (pipe_fds[1], msg, cookie_len + 1) != (ssize_t) (cookie_len + 1)) {
+		errsv = errno;
+		goto fail;
+	}
+	close (pipe_fds[1]);
+	if (dup2 (pipe_fds[0], 0) < 0) {
+		errsv = errno;
+		goto fail;
+	}
+	if (pipe_fds[0] != 0)
+		close (pipe_fds[0]);
+
+	/* Our environment, with the helper channel pointing at @helper_fd */
+	for (i = 0; environ[i] && envc < LAUNCHER_MAX_ENV; i++) {
+		if (strncmp (environ[i], helper_env, NM_STRLEN (NM_OPENCONNECT_HELPER_FD_ENV) + 1))
+			child_envp[envc++] = environ[i];
+	}
+	if (helper_fd >= 0) {
+		p = helper_env + NM_STRLEN (NM_OPENCONNECT_HELPER_FD_ENV) + 1;
+		n = 0;
+		do {
+			digits[n++] = '0' + helper_fd % 10;
+			helper_fd /= 10;
+		} while (helper_fd);
+		while (n)
+			*p++ = digits[--n];
+		*p = '\0';
+		child_envp[envc++] = helper_env;
+	}
+	child_envp[envc] = NULL;
+
+	execve (child_argv[0], child_argv, child_envp);
+	errsv = errno;
+
+fail:
+	if (write (fd, &errsv, sizeof (errsv)) < 0) {
+		/* Nothing left to tell anyone */
+	}
+	_exit (127);
+}
+
+static gboolean
+launcher_spawn (void)
+{
+	int sv[2];
+	int max_fd;
+	pid_t parent;
+	pid_t pid;
+
+	if (!gl.have_tun_owner)
+		return FALSE;
+
+	if (!launcher_groups) {
+		launcher_n_groups = 64;
+		launcher_groups = g_new (gid_t, launcher_n_groups);
+		if (getgrouplist (NM_OPENCONNECT_USER, gl.tun_group,
+		                  launcher_groups, &launcher_n_groups) < 0) {
+			launcher_groups = g_renew (gid_t, launcher_groups, launcher_n_groups);
+			getgrouplist (NM_OPENCONNECT_USER, gl.tun_group,
+			              launcher_groups, &launcher_n_groups);
+		}
+	}
+
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		_LOGW ("Failed to create launcher socket: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	max_fd = sysconf (_SC_OPEN_MAX);
+	parent = getpid ();
+	pid = fork ();
+	if (pid < 0) {
+		_LOGW ("Failed to fork launcher: %s", g_strerror (errno));
+		close (sv[0]);
+		close (sv[1]);
+		return FALSE;
+	}
+	if (pid == 0)
+		launcher_child_main (sv[1], parent, max_fd);
+
+	close (sv[1]);
+	gl.launcher_pid = pid;
+	gl.launcher_fd = sv[0];
+	_LOGD ("Pre-forked openconnect launcher with pid %d", pid);
+	return TRUE;
+}
+
+static gboolean
+launcher_spawn_cb (gpointer user_data)
+{
+	gl.launcher_spawn_id = 0;
+	if (!gl.launcher_pid)
+		launcher_spawn ();
+	return G_SOURCE_REMOVE;
+}
+
+static void
+launcher_schedule_spawn (void)
+{
+	if (!gl.prefork || gl.launcher_pid || gl.launcher_spawn_id)
+		return;
+
+	gl.launcher_spawn_id = g_idle_add_full (G_PRIORITY_LOW, launcher_spawn_cb, NULL, NULL);
+}
+
+static void
+launcher_reaped_cb (GPid pid, gint status, gpointer user_data)
+{
+	g_spawn_close_pid (pid);
+}
+
+static void
+launcher_stop (void)
+{
+	nm_clear_g_source (&gl.launcher_spawn_id);
+
+	/* The launcher exits once its socket hits EOF, and whatever is left
+	 * of it is reaped by init once we are gone */
+	if (gl.launcher_pid) {
+		close (gl.launcher_fd);
+		gl.launcher_pid = 0;
+	}
+}
+
+static ssize_t
+launcher_read (int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	do {
+		n = read (fd, buf, len);
+	} while (n < 0 && errno == EINTR);
+	return n;
+}
+
+/* Called with the pid of openconnect, or 0 if the launcher failed */
+typedef void (*LauncherExecCallback) (GPid pid, gpointer user_data);
+
+struct _LauncherExec {
+	GPid pid;
+	int fd;
+	gboolean acked;
+	guint watch_id;
+	guint timeout_id;
+	LauncherExecCallback callback;
+	gpointer user_data;
+};
+
+static void
+launcher_exec_free (LauncherExec *exec)
+{
+	nm_clear_g_source (&exec->watch_id);
+	nm_clear_g_source (&exec->timeout_id);
+	close (exec->fd);
+	g_slice_free (LauncherExec, exec);
+}
+
+/* Kills what is left of the launcher, and reaps it from the main loop */
+static void
+launcher_exec_kill (LauncherExec *exec)
+{
+	kill (exec->pid, SIGKILL);
+	g_child_watch_add (exec->pid, launcher_reaped_cb, NULL);
+}
+
+static void
+launcher_exec_complete (LauncherExec *exec, GPid pid)
+{
+	LauncherExecCallback callback = exec->callback;
+	gpointer user_data = exec->user_data;
+
+	launcher_exec_free (exec);
+	callback (pid, user_data);
+}
+
+static gboolean
+launcher_exec_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+	LauncherExec *exec = user_data;
+	char ack;
+	int errsv;
+	ssize_t n;
+
+	if (!exec->acked) {
+		n = launcher_read (fd, &ack, 1);
+		if (n < 0 && errno == EAGAIN)
+			return G_SOURCE_CONTINUE;
+		if (n == 1) {
+			exec->acked = TRUE;
+			return G_SOURCE_CONTINUE;
+		}
+		_LOGW ("Pre-forked launcher %d is gone; spawning openconnect directly", exec->pid);
+		launcher_exec_kill (exec);
+		exec->watch_id = 0;
+		launcher_exec_complete (exec, 0);
+		return G_SOURCE_REMOVE;
+	}
+
+	n = launcher_read (fd, &errsv, sizeof (errsv));
+	if (n < 0 && errno == EAGAIN)
+		return G_SOURCE_CONTINUE;
+
+	exec->watch_id = 0;
+	if (n != 0) {
+		_LOGW ("Pre-forked launcher failed to start openconnect: %s",
+		       n == sizeof (errsv) ? g_strerror (errsv) : "unknown error");
+		/* It exits right after telling */
+		g_child_watch_add (exec->pid, launcher_reaped_cb, NULL);
+		launcher_exec_complete (exec, 0);
+	} else
+		launcher_exec_complete (exec, exec->pid);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+launcher_exec_timeout_cb (gpointer user_data)
+{
+	LauncherExec *exec = user_data;
+
+	_LOGW ("Pre-forked launcher %d did not start openconnect in time; spawning it directly",
+	       exec->pid);
+	launcher_exec_kill (exec);
+	exec->timeout_id = 0;
+	launcher_exec_complete (exec, 0);
+	return G_SOURCE_REMOVE;
+}
+
+/* Drops an exec in progress without calling back. Whatever the launcher
+ * got to start is killed. */
+static void
+launcher_exec_cancel (LauncherExec *exec)
+{
+	launcher_exec_kill (exec);
+	launcher_exec_free (exec);
+}
+
+/* Hands @argv, @cookie and @helper_fd to the pre-forked launcher, and
+ * calls @callback once it has started openconnect. Returns NULL if no
+ * launcher is available or it couldn't be told, in which case the caller
+ * spawns openconnect itself. */
+static LauncherExec *
+launcher_exec_start (const char *const *argv, const char *cookie, int helper_fd,
+                     LauncherExecCallback callback, gpointer user_data)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (sizeof (int))];
+	} control;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	LauncherExec *exec;
+	GString *msg;
+	const char *const *arg;
+	ssize_t n;
+
+	if (!gl.launcher_pid)
+		return NULL;
+
+	exec = g_slice_new0 (LauncherExec);
+	exec->pid = gl.launcher_pid;
+	exec->fd = gl.launcher_fd;
+	exec->callback = callback;
+	exec->user_data = user_data;
+
+	/* A launcher is used at most once, whatever the outcome */
+	gl.launcher_pid = 0;
+	launcher_schedule_spawn ();
+
+	msg = g_string_new (cookie);
+	g_string_append_c (msg, '\0');
+	for (arg = argv; *arg; arg++) {
+		g_string_append (msg, *arg);
+		g_string_append_c (msg, '\0');
+	}
+
+	iov.iov_base = msg->str;
+	iov.iov_len = msg->len;
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (helper_fd >= 0) {
+		memset (&control, 0, sizeof (control));
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof (control.buf);
+		cmsg = CMSG_FIRSTHDR (&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+		memcpy (CMSG_DATA (cmsg), &helper_fd, sizeof (int));
+	}
+
+	/* The launcher sits in recvmsg(), so the message goes straight into
+	 * its receive queue; if it doesn't, don't wait for room */
+	do {
+		n = sendmsg (exec->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (n < 0 && errno == EINTR);
+
+	memset (msg->str, 0, msg->len);
+	g_string_free (msg, TRUE);
+
+	if (   n < 0
+	    || !g_unix_set_fd_nonblocking (exec->fd, TRUE, NULL)) {
+		_LOGW ("Pre-forked launcher %d is gone; spawning openconnect directly", exec->pid);
+		launcher_exec_cancel (exec);
+		return NULL;
+	}
+
+	exec->watch_id = g_unix_fd_add (exec->fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+	                                launcher_exec_cb, exec);
+	exec->timeout_id = g_timeout_add (NM_OPENCONNECT_LAUNCHER_TIMEOUT,
+	                                  launcher_exec_timeout_cb, exec);
+	return exec;
+}
+
+/*****************************************************************************/
+
+/* openconnect runs the helper as its script for every state change. The
+ * helper used to translate its environment and push it over D-Bus; it
+ * now forwards the raw environment to us over a socketpair inherited
+ * through openconnect, and we translate and apply it in-process.
+ *
+ * Each message is a guint32 length followed by NUL-terminated KEY=VALUE
+ * entries. We answer every message with a single status byte, which the
+ * helper uses as its exit status. */
+
+static void
+tunnel_helper_close (OpenconnectTunnel *tunnel)
+{
+	nm_clear_g_source (&tunnel->helper_watch_id);
+	if (tunnel->helper_fd >= 0) {
+		close (tunnel->helper_fd);
+		tunnel->helper_fd = -1;
+	}
+	if (tunnel->helper_child_fd >= 0) {
+		close (tunnel->helper_child_fd);
+		tunnel->helper_child_fd = -1;
+	}
+	if (tunnel->helper_buf) {
+		g_byte_array_unref (tunnel->helper_buf);
+		tunnel->helper_buf = NULL;
+	}
+}
+
+static gboolean
+variant_equal0 (GVariant *a, GVariant *b)
+{
+	if (a == b)
+		return TRUE;
+	return a && b && g_variant_equal (a, b);
+}
+
+static GHashTable *
+variant_elements (GVariant *array)
+{
+	GHashTable *set;
+	GVariantIter iter;
+	GVariant *child;
+
+	set = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+	                             (GDestroyNotify) g_bytes_unref, NULL);
+	if (array) {
+		g_variant_iter_init (&iter, array);
+		while ((child = g_variant_iter_next_value (&iter))) {
+			g_hash_table_add (set, g_variant_get_data_as_bytes (child));
+			g_variant_unref (child);
+		}
+	}
+	return set;
+}
+
+static guint
+variant_elements_missing (GHashTable *set, GHashTable *from)
+{
+	GHashTableIter iter;
+	gpointer key;
+	guint n = 0;
+
+	g_hash_table_iter_init (&iter, set);
+	while (g_hash_table_iter_next (&iter, &key, NULL)) {
+		if (!g_hash_table_contains (from, key))
+			n++;
+	}
+	return n;
+}
+
+/* Logs how the array at @key changed between two configurations */
+static void
+config_log_delta (const char *family, const char *key,
+                  GVariant *old_dict, GVariant *new_dict)
+{
+	GVariant *old_value = NULL, *new_value = NULL;
+	GHashTable *old_set, *new_set;
+	guint added, removed;
+
+	if (old_dict)
+		old_value = g_variant_lookup_value (old_dict, key, NULL);
+	if (new_dict)
+		new_value = g_variant_lookup_value (new_dict, key, NULL);
+
+	if (!variant_equal0 (old_value, new_value)) {
+		old_set = variant_elements (old_value && g_variant_is_container (old_value) ? old_value : NULL);
+		new_set = variant_elements (new_value && g_variant_is_container (new_value) ? new_value : NULL);
+		added = variant_elements_missing (new_set, old_set);
+		removed = variant_elements_missing (old_set, new_set);
+		_LOGI ("%s %s changed: %u added, %u removed", family, key, added, removed);
+		g_hash_table_unref (old_set);
+		g_hash_table_unref (new_set);
+	}
+
+	if (old_value)
+		g_variant_unref (old_value);
+	if (new_value)
+		g_variant_unref (new_value);
+}
+
+/* Hands a configuration to NetworkManager, skipping what it already has.
+ * NetworkManager only takes complete dictionaries, so a changed family
+ * is sent whole; an unchanged one is not sent at all. Takes ownership
+ * of the references. */
+static void
+tunnel_config_push (OpenconnectTunnel *tunnel, GVariant *config,
+                    GVariant *ip4config, GVariant *ip6config)
+{
+	NMVpnServicePlugin *plugin = NM_VPN_SERVICE_PLUGIN (tunnel->plugin);
+	gboolean full;
+
+	/* Anything but address families changing means starting over */
+	full = !variant_equal0 (tunnel->last_config, config);
+
+	if (!full) {
+		if (   variant_equal0 (tunnel->last_ip4config, ip4config)
+		    && variant_equal0 (tunnel->last_ip6config, ip6config)) {
+			_LOGI ("Configuration unchanged; keeping the current one");
+			goto out;
+		}
+
+		config_log_delta ("IPv4", NM_VPN_PLUGIN_IP4_CONFIG_ROUTES, tunnel->last_ip4config, ip4config);
+		config_log_delta ("IPv4", NM_VPN_PLUGIN_IP4_CONFIG_DNS, tunnel->last_ip4config, ip4config);
+		config_log_delta ("IPv4", NM_VPN_PLUGIN_IP4_CONFIG_DOMAINS, tunnel->last_ip4config, ip4config);
+		config_log_delta ("IPv6", NM_VPN_PLUGIN_IP6_CONFIG_ROUTES, tunnel->last_ip6config, ip6config);
+		config_log_delta ("IPv6", NM_VPN_PLUGIN_IP6_CONFIG_DNS, tunnel->last_ip6config, ip6config);
+		config_log_delta ("IPv6", NM_VPN_PLUGIN_IP6_CONFIG_DOMAIN, tunnel->last_ip6config, ip6config);
+	}
+
+	if (full)
+		nm_vpn_service_plugin_set_config (plugin, config);
+	if (ip4config && (full || !variant_equal0 (tunnel->last_ip4config, ip4config)))
+		nm_vpn_service_plugin_set_ip4_config (plugin, ip4config);
+	if (ip6config && (full || !variant_equal0 (tunnel->last_ip6config, ip6config)))
+		nm_vpn_service_plugin_set_ip6_config (plugin, ip6config);
+
+out:
+	g_clear_pointer (&tunnel->last_config, g_variant_unref);
+	g_clear_pointer (&tunnel->last_ip4config, g_variant_unref);
+	g_clear_pointer (&tunnel->last_ip6config, g_variant_unref);
+	tunnel->last_config = config;
+	tunnel->last_ip4config = ip4config;
+	tunnel->last_ip6config = ip6config;
+}
+
+/* openconnect calls its script with "pre-init" before bringing the
+ * tunnel up, "connect" once it is up, "attempt-reconnect" when it lost
+ * the connection and tries to get it back, "reconnect" when it did, and
+ * "disconnect" on the way out. Across a reconnect NetworkManager keeps
+ * the configuration it has; we only push what changed. */
+static guint8
+tunnel_helper_event (OpenconnectTunnel *tunnel, const char *reason,
+                     const char *const *envp)
+{
+	NMVpnServicePlugin *plugin = NM_VPN_SERVICE_PLUGIN (tunnel->plugin);
+	GVariant *config, *ip4config, *ip6config;
+	const char *failure = NULL;
+	gboolean reconnect;
+
+	if (!reason)
+		reason = "connect";
+	_LOGD ("openconnect event '%s'", reason);
+
+	/* The plugin may belong to a new connection by now */
+	if (   tunnel->state == OC_TUNNEL_STATE_STOPPING
+	    || tunnel->state == OC_TUNNEL_STATE_FAILED)
+		return 0;
+
+	if (!strcmp (reason, "attempt-reconnect")) {
+		if (tunnel->state == OC_TUNNEL_STATE_RUNNING) {
+			_LOGI ("openconnect is reconnecting; keeping the current configuration");
+			tunnel->state = OC_TUNNEL_STATE_RECONNECTING;
+			tunnel->reconnect_start = g_get_monotonic_time ();
+		}
+		return 0;
+	}
+
+	reconnect = !strcmp (reason, "reconnect");
+	if (!reconnect && strcmp (reason, "connect")) {
+		/* "pre-init" and "disconnect" need nothing from us; the
+		 * child watch deals with openconnect going away. */
+		return 0;
+	}
+
+	if (tunnel->state == OC_TUNNEL_STATE_RECONNECTING) {
+		_LOGI ("openconnect reconnected after %" G_GINT64_FORMAT " ms",
+		       (g_get_monotonic_time () - tunnel->reconnect_start) / 1000);
+		tunnel->state = OC_TUNNEL_STATE_RUNNING;
+		tunnel->reconnect_start = 0;
+	}
+
+	if (!nm_openconnect_config_from_env (envp, &config, &ip4config, &ip6config,
+	                                     &failure)) {
+		if (reconnect && tunnel->last_config) {
+			_LOGW ("openconnect helper did not receive a valid %s on reconnect; keeping the current configuration",
+			       failure);
+			return 0;
+		}
+		_LOGW ("openconnect helper did not receive a valid %s", failure);
+		nm_vpn_service_plugin_failure (plugin, NM_VPN_PLUGIN_FAILURE_BAD_IP_CONFIG);
+		return 1;
+	}
+
+	tunnel_config_push (tunnel, config, ip4config, ip6config);
+	return 0;
+}
+
+static guint8
+tunnel_helper_apply (OpenconnectTunnel *tunnel, char *data, guint32 len)
+{
+	GPtrArray *envp;
+	const char *reason = NULL;
+	guint8 status;
+	char *p;
+
+	if (len == 0 || data[len - 1] != '\0') {
+		_LOGW ("Malformed message from the openconnect helper");
+		return 1;
+	}
+
+	envp = g_ptr_array_new ();
+	for (p = data; p < data + len; p += strlen (p) + 1) {
+		if (!strncmp (p, "reason=", NM_STRLEN ("reason=")))
+			reason = p + NM_STRLEN ("reason=");
+		g_ptr_array_add (envp, p);
+	}
+	g_ptr_array_add (envp, NULL);
+
+	status = tunnel_helper_event (tunnel, reason, (const char *const *) envp->pdata);
+
+	g_ptr_array_free (envp, TRUE);
+	return status;
+}
+
+static gboolean
+tunnel_helper_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+	GByteArray *buf = tunnel->helper_buf;
+	guint8 chunk[4096];
+	guint8 status;
+	guint32 len;
+	ssize_t n;
+
+	n = read (fd, chunk, sizeof (chunk));
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return G_SOURCE_CONTINUE;
+	if (n <= 0) {
+		/* Every holder of the other end, openconnect included, is gone */
+		tunnel->helper_watch_id = 0;
+		tunnel_helper_close (tunnel);
+		return G_SOURCE_REMOVE;
+	}
+	g_byte_array_append (buf, chunk, n);
+
+	while (buf->len >= sizeof (len)) {
+		memcpy (&len, buf->data, sizeof (len));
+		if (len > NM_OPENCONNECT_HELPER_MAX_MSG) {
+			_LOGW ("Oversized message from the openconnect helper");
+			tunnel->helper_watch_id = 0;
+			tunnel_helper_close (tunnel);
+			return G_SOURCE_REMOVE;
+		}
+		if (buf->len - sizeof (len) < len)
+			break;
+
+		status = tunnel_helper_apply (tunnel, (char *) buf->data + sizeof (len), len);
+		if (write (fd, &status, 1) != 1)
+			_LOGW ("Could not reply to the openconnect helper: %s", g_strerror (errno));
+		g_byte_array_remove_range (buf, 0, sizeof (len) + len);
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+tunnel_helper_open (OpenconnectTunnel *tunnel, GError **error)
+{
+	int sv[2];
+
+	if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+		             _("Could not create the helper socket: %s"),
+		             g_strerror (errno));
+		return FALSE;
+	}
+
+	g_unix_set_fd_nonblocking (sv[0], TRUE, NULL);
+	tunnel->helper_fd = sv[0];
+	tunnel->helper_child_fd = sv[1];
+	tunnel->helper_buf = g_byte_array_new ();
+	tunnel->helper_watch_id = g_unix_fd_add (sv[0], G_IO_IN | G_IO_HUP | G_IO_ERR,
+	                                         tunnel_helper_cb, tunnel);
+	return TRUE;
+}
+
+/*****************************************************************************/
+
+static void
+tunnel_cookie_clear (OpenconnectTunnel *tunnel)
+{
+	nm_clear_g_source (&tunnel->cookie_watch_id);
+	nm_clear_g_source (&tunnel->cookie_timeout_id);
+	if (tunnel->cookie_fd >= 0) {
+		close (tunnel->cookie_fd);
+		tunnel->cookie_fd = -1;
+	}
+	if (tunnel->cookie) {
+		memset (tunnel->cookie, 0, tunnel->cookie_len);
+		g_free (tunnel->cookie);
+		tunnel->cookie = NULL;
+	}
+}
+
+/* Signals go through the pidfd where there is one, so they can never
+ * reach an unrelated process that got the PID after openconnect was
+ * reaped. */
+static int
+tunnel_signal (OpenconnectTunnel *tunnel, int sig)
+{
+#ifdef __NR_pidfd_send_signal
+	if (tunnel->pidfd >= 0)
+		return syscall (__NR_pidfd_send_signal, tunnel->pidfd, sig, NULL, 0);
+#endif
+	return kill (tunnel->pid, sig);
+}
+
+static gboolean
+tunnel_pidfd_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+
+	/* openconnect is gone; the child watch reaps it and reports */
+	tunnel->pidfd_watch_id = 0;
+	nm_clear_g_source (&tunnel->kill_id);
+	if (tunnel->stop_start) {
+		_LOGD ("openconnect exited %" G_GINT64_FORMAT " ms after being told to",
+		       (g_get_monotonic_time () - tunnel->stop_start) / 1000);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void
+tunnel_pidfd_open (OpenconnectTunnel *tunnel)
+{
+#ifdef __NR_pidfd_open
+	tunnel->pidfd = syscall (__NR_pidfd_open, tunnel->pid, 0);
+	if (tunnel->pidfd >= 0) {
+		fcntl (tunnel->pidfd, F_SETFD, FD_CLOEXEC);
+		tunnel->pidfd_watch_id = g_unix_fd_add (tunnel->pidfd, G_IO_IN,
+		                                        tunnel_pidfd_cb, tunnel);
+	}
+#endif
+}
+
+static OpenconnectTunnel *
+tunnel_new (NMOpenconnectPlugin *plugin, const char *uuid)
+{
+	OpenconnectTunnel *tunnel;
+
+	tunnel = g_slice_new0 (OpenconnectTunnel);
+	tunnel->plugin = plugin;
+	tunnel->uuid = g_strdup (uuid);
+	tunnel->state = OC_TUNNEL_STATE_STARTING;
+	tunnel->helper_fd = -1;
+	tunnel->helper_child_fd = -1;
+	tunnel->cookie_fd = -1;
+	tunnel->pidfd = -1;
+	return tunnel;
+}
 
-	if (tun_name) {
-		if (initgroups (NM_OPENCONNECT_USER, gl.tun_group) ||
-		    setgid (gl.tun_group) || setuid (gl.tun_owner)) {
-			_LOGW ("Failed to drop privileges when spawning openconnect");
-			exit (1);
-		}
+static void
+tunnel_free (OpenconnectTunnel *tunnel)
+{
+	nm_clear_g_source (&tunnel->watch_id);
+	nm_clear_g_source (&tunnel->connect_id);
+	nm_clear_g_source (&tunnel->pidfd_watch_id);
+	nm_clear_g_source (&tunnel->kill_id);
+	if (tunnel->pidfd >= 0)
+		close (tunnel->pidfd);
+	if (tunnel->probe_cancellable) {
+		g_cancellable_cancel (tunnel->probe_cancellable);
+		g_object_unref (tunnel->probe_cancellable);
+	}
+	if (tunnel->tun_cancellable) {
+		g_cancellable_cancel (tunnel->tun_cancellable);
+		g_object_unref (tunnel->tun_cancellable);
 	}
+	if (tunnel->launch)
+		launcher_exec_cancel (tunnel->launch);
+	tunnel_cookie_clear (tunnel);
+	g_clear_object (&tunnel->connection);
+	if (tunnel->argv)
+		g_ptr_array_free (tunnel->argv, TRUE);
+	tunnel_helper_close (tunnel);
+	g_clear_pointer (&tunnel->last_config, g_variant_unref);
+	g_clear_pointer (&tunnel->last_ip4config, g_variant_unref);
+	g_clear_pointer (&tunnel->last_ip6config, g_variant_unref);
+
+	/* A device still attached to a running openconnect can't go back to
+	 * the pool; it is left to openconnect in that case. */
+	if (tunnel->tun_name && !tunnel->pid)
+		tun_pool_release (tunnel->tun_name);
+	else
+		g_free (tunnel->tun_name);
+
+	g_free (tunnel->uuid);
+	g_slice_free (OpenconnectTunnel, tunnel);
 }
 
 static void
 openconnect_watch_cb (GPid pid, gint status, gpointer user_data)
 {
-	NMOpenconnectPlugin *plugin = NM_OPENCONNECT_PLUGIN (user_data);
+	OpenconnectTunnel *tunnel = user_data;
+	NMOpenconnectPlugin *plugin = tunnel->plugin;
 	NMOpenconnectPluginPrivate *priv = NM_OPENCONNECT_PLUGIN_GET_PRIVATE (plugin);
 	guint error = 0;
 
@@ -354,15 +2097,23 @@ openconnect_watch_cb (GPid pid, gint status, gpointer user_data)
 		_LOGW ("openconnect died from an unknown cause");
 
 	/* Reap child if needed. */
-	waitpid (priv->pid, NULL, WNOHANG);
-	priv->pid = 0;
-
-	if (priv->tun_name) {
-		destroy_persistent_tundev (priv->tun_name);
-		g_free (priv->tun_name);
-		priv->tun_name = NULL;
+	waitpid (tunnel->pid, NULL, WNOHANG);
+	tunnel->pid = 0;
+	tunnel->watch_id = 0;
+
+	/* We asked it to go, or killed it after a failed connect.
+	 * NetworkManager was told the connection stopped or failed back
+	 * then, and may have started it again since. */
+	if (   tunnel->state == OC_TUNNEL_STATE_STOPPING
+	    || tunnel->state == OC_TUNNEL_STATE_FAILED) {
+		priv->stopping = g_slist_remove (priv->stopping, tunnel);
+		tunnel_free (tunnel);
+		return;
 	}
 
+	/* Hands the tun device back to the pool */
+	g_hash_table_remove (priv->tunnels, tunnel->uuid);
+
 	/* Must be after data->state is set since signals use data->state */
 	switch (error) {
 	case 2:
@@ -379,58 +2130,56 @@ openconnect_watch_cb (GPid pid, gint status, gpointer user_data)
 	}
 }
 
-static gint
-nm_openconnect_start_openconnect_binary (NMOpenconnectPlugin *plugin,
-                                         NMSettingVpn *s_vpn,
-                                         GError **error)
+/* A connect runs as a sequence of stages, one per main loop iteration,
+ * so that other requests are served in between. A failing stage reports
+ * the failure to NetworkManager and drops the tunnel. */
+
+static const char *const connect_stage_names[] = {
+	[OC_CONNECT_STAGE_BINARY] = "binary",
+	[OC_CONNECT_STAGE_TUNDEV] = "tundev",
+	[OC_CONNECT_STAGE_SPAWN]  = "spawn",
+	[OC_CONNECT_STAGE_COOKIE] = "cookie",
+};
+
+static gboolean tunnel_connect_cb (gpointer user_data);
+
+static void
+tunnel_binary_probed (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+	GCancellable *cancellable = g_task_get_cancellable (G_TASK (result));
+
+	openconnect_binary_probe_finish (result);
+	if (g_cancellable_is_cancelled (cancellable))
+		return;
+
+	g_clear_object (&tunnel->probe_cancellable);
+	tunnel->connect_id = g_idle_add (tunnel_connect_cb, tunnel);
+}
+
+/* Looks up openconnect and builds its command line. If the binary has
+ * to be probed first, that is started and the stage runs again once it
+ * is done. */
+static gboolean
+tunnel_connect_binary (OpenconnectTunnel *tunnel, NMSettingVpn *s_vpn, GError **error)
 {
-	NMOpenconnectPluginPrivate *priv = NM_OPENCONNECT_PLUGIN_GET_PRIVATE (plugin);
-	GPid	pid;
-	const char **openconnect_binary = NULL;
+	OpenconnectBinary *binary;
 	GPtrArray *openconnect_argv;
-	GSource *openconnect_watch;
-	gint	stdin_fd;
-	const char *props_vpn_gw, *props_cookie, *props_cacert, *props_mtu, *props_gwcert, *props_proxy;
+	const char *props_cacert, *props_mtu, *props_gwcert, *props_proxy;
 	const char *protocol;
 
-	/* Find openconnect */
-	openconnect_binary = openconnect_binary_paths;
-	while (*openconnect_binary != NULL) {
-		if (g_file_test (*openconnect_binary, G_FILE_TEST_EXISTS))
-			break;
-		openconnect_binary++;
-	}
-
-	if (!*openconnect_binary) {
-		g_set_error (error,
-		             NM_VPN_PLUGIN_ERROR,
-		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
-		             "%s",
-		             _("Could not find openconnect binary."));
-		return -1;
-	}
+	binary = openconnect_binary_get (error);
+	if (!binary)
+		return FALSE;
 
-	/* The actual gateway to use (after redirection) comes from the auth
-	   dialog, so it's in the secrets hash not the properties */
-	props_vpn_gw = nm_setting_vpn_get_secret (s_vpn, NM_OPENCONNECT_KEY_GATEWAY);
-	if (!props_vpn_gw || !strlen (props_vpn_gw) ) {
-		g_set_error (error,
-		             NM_VPN_PLUGIN_ERROR,
-		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
-		             "%s",
-		             _("No VPN gateway specified."));
-		return -1;
+	protocol = nm_setting_vpn_get_data_item (s_vpn, NM_OPENCONNECT_KEY_PROTOCOL);
+	if (protocol && !strcmp (protocol, "juniper") && !binary->probed) {
+		tunnel->probe_cancellable = g_cancellable_new ();
+		openconnect_binary_probe_async (binary, tunnel->probe_cancellable,
+		                                tunnel_binary_probed, tunnel);
+		return TRUE;
 	}
 
-	props_cookie = nm_setting_vpn_get_secret (s_vpn, NM_OPENCONNECT_KEY_COOKIE);
-	if (!props_cookie || !strlen (props_cookie)) {
-		g_set_error (error,
-		             NM_VPN_PLUGIN_ERROR,
-		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
-		             "%s",
-		             _("No WebVPN cookie provided."));
-		return -1;
-	}
 	props_gwcert = nm_setting_vpn_get_secret (s_vpn, NM_OPENCONNECT_KEY_GWCERT);
 
 	props_cacert = nm_setting_vpn_get_data_item (s_vpn, NM_OPENCONNECT_KEY_CACERT);
@@ -438,112 +2187,470 @@ nm_openconnect_start_openconnect_binary (NMOpenconnectPlugin *plugin,
 
 	props_proxy = nm_setting_vpn_get_data_item (s_vpn, NM_OPENCONNECT_KEY_PROXY);
 
-	openconnect_argv = g_ptr_array_new ();
-	g_ptr_array_add (openconnect_argv, (gpointer) (*openconnect_binary));
-
-	protocol = nm_setting_vpn_get_data_item (s_vpn, NM_OPENCONNECT_KEY_PROTOCOL);
-	if (protocol && strcmp (protocol, "anyconnect")) {
-		/* Special case for OpenConnect 7.06 which had --juniper but not --protocol */
-		if (!strcmp (protocol, "juniper"))
-			g_ptr_array_add (openconnect_argv, (gpointer) "--juniper");
-		else {
-			g_ptr_array_add (openconnect_argv, (gpointer) "--protocol");
-			g_ptr_array_add (openconnect_argv, (gpointer) protocol);
-		}
+	openconnect_argv = g_ptr_array_new_with_free_func (g_free);
+	g_ptr_array_add (openconnect_argv, g_strdup (binary->path));
+
+	if (protocol && !strcmp (protocol, "juniper")) {
+		/* OpenConnect 7.06 had --juniper but not --protocol. Unless the
+		 * probe found --protocol and no --juniper, stay with the latter. */
+		if ((binary->caps & OC_CAP_PROTOCOL) && !(binary->caps & OC_CAP_JUNIPER)) {
+			g_ptr_array_add (openconnect_argv, g_strdup ("--protocol"));
+			g_ptr_array_add (openconnect_argv, g_strdup ("nc"));
+		} else
+			g_ptr_array_add (openconnect_argv, g_strdup ("--juniper"));
+	} else if (protocol && strcmp (protocol, "anyconnect")) {
+		g_ptr_array_add (openconnect_argv, g_strdup ("--protocol"));
+		g_ptr_array_add (openconnect_argv, g_strdup (protocol));
 	}
 
 	if (props_gwcert && strlen(props_gwcert)) {
-		g_ptr_array_add (openconnect_argv, (gpointer) "--servercert");
-		g_ptr_array_add (openconnect_argv, (gpointer) props_gwcert);
+		g_ptr_array_add (openconnect_argv, g_strdup ("--servercert"));
+		g_ptr_array_add (openconnect_argv, g_strdup (props_gwcert));
 	} else if (props_cacert && strlen(props_cacert)) {
-		g_ptr_array_add (openconnect_argv, (gpointer) "--cafile");
-		g_ptr_array_add (openconnect_argv, (gpointer) props_cacert);
+		g_ptr_array_add (openconnect_argv, g_strdup ("--cafile"));
+		g_ptr_array_add (openconnect_argv, g_strdup (props_cacert));
 	}
 
 	if (props_mtu && strlen(props_mtu)) {
-		g_ptr_array_add (openconnect_argv, (gpointer) "--mtu");
-		g_ptr_array_add (openconnect_argv, (gpointer) props_mtu);
+		g_ptr_array_add (openconnect_argv, g_strdup ("--mtu"));
+		g_ptr_array_add (openconnect_argv, g_strdup (props_mtu));
 	}
 
 	if (props_proxy && strlen(props_proxy)) {
-		g_ptr_array_add (openconnect_argv, (gpointer) "--proxy");
-		g_ptr_array_add (openconnect_argv, (gpointer) props_proxy);
+		g_ptr_array_add (openconnect_argv, g_strdup ("--proxy"));
+		g_ptr_array_add (openconnect_argv, g_strdup (props_proxy));
 	}
 
-	g_ptr_array_add (openconnect_argv, (gpointer) "--syslog");
-	g_ptr_array_add (openconnect_argv, (gpointer) "--cookie-on-stdin");
+	g_ptr_array_add (openconnect_argv, g_strdup ("--syslog"));
+	g_ptr_array_add (openconnect_argv, g_strdup ("--cookie-on-stdin"));
+
+	g_ptr_array_add (openconnect_argv, g_strdup ("--script"));
+	g_ptr_array_add (openconnect_argv, g_strdup (gl.helper_path ?: NM_OPENCONNECT_HELPER_PATH));
+
+	tunnel->argv = openconnect_argv;
+	return TRUE;
+}
+
+static void tunnel_connect_fail (OpenconnectTunnel *tunnel, GError *error);
+
+static void
+tunnel_tundev_created (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+	GCancellable *cancellable = g_task_get_cancellable (G_TASK (result));
+	GError *error = NULL;
+	char *tun_name;
 
-	g_ptr_array_add (openconnect_argv, (gpointer) "--script");
-	g_ptr_array_add (openconnect_argv, (gpointer) NM_OPENCONNECT_HELPER_PATH);
+	tun_name = tun_create_finish (result, &error);
+	if (g_cancellable_is_cancelled (cancellable)) {
+		/* The tunnel is gone, but the device was never used */
+		if (tun_name)
+			tun_pool_put (tun_name);
+		g_clear_error (&error);
+		return;
+	}
 
-	priv->tun_name = create_persistent_tundev ();
-	if (priv->tun_name) {
-		g_ptr_array_add (openconnect_argv, (gpointer) "--interface");
-		g_ptr_array_add (openconnect_argv, (gpointer) priv->tun_name);
+	g_clear_object (&tunnel->tun_cancellable);
+	if (!tun_name) {
+		tunnel_connect_fail (tunnel, error);
+		return;
 	}
 
-	g_ptr_array_add (openconnect_argv, (gpointer) props_vpn_gw);
+	tunnel->tun_name = tun_name;
+	tunnel->connect_id = g_idle_add (tunnel_connect_cb, tunnel);
+}
+
+/* Takes a tun device from the pool, or has one created in a worker
+ * thread; the connect then resumes once that is done. */
+static gboolean
+tunnel_connect_tundev (OpenconnectTunnel *tunnel, NMSettingVpn *s_vpn, GError **error)
+{
+	int fd;
+
+	tunnel->tun_name = tun_pool_take ();
+	if (tunnel->tun_name)
+		return TRUE;
 
-	if (gl.log_level >= LOG_INFO) {
-		g_ptr_array_add (openconnect_argv, (gpointer) "--verbose");
-		if (gl.log_level >= LOG_DEBUG)
-			g_ptr_array_add (openconnect_argv, (gpointer) "--verbose");
+	if (gl.have_tun_owner) {
+		tunnel->tun_cancellable = g_cancellable_new ();
+		tun_create_async (tunnel->tun_cancellable, tunnel_tundev_created, tunnel);
+		return TRUE;
 	}
 
-	g_ptr_array_add (openconnect_argv, NULL);
+	/* Without an unprivileged user openconnect creates its own device,
+	 * so just make sure it will find the module loaded */
+	fd = tun_open ();
+	if (fd >= 0)
+		close (fd);
+	return TRUE;
+}
+
+/* openconnect is up, however it was started */
+static void
+tunnel_spawned (OpenconnectTunnel *tunnel, GPid pid)
+{
+	/* openconnect holds the other end now */
+	close (tunnel->helper_child_fd);
+	tunnel->helper_child_fd = -1;
+
+	tunnel->pid = pid;
+	tunnel->watch_id = g_child_watch_add (pid, openconnect_watch_cb, tunnel);
+	tunnel->state = OC_TUNNEL_STATE_RUNNING;
+	tunnel_pidfd_open (tunnel);
+}
+
+static gboolean
+tunnel_spawn_direct (OpenconnectTunnel *tunnel, GError **error)
+{
+	char **openconnect_envp;
+	char sbuf[16];
+	GPid pid;
 
-	if (!g_spawn_async_with_pipes (NULL, (char **) openconnect_argv->pdata, NULL,
+	openconnect_envp = g_environ_setenv (g_get_environ (), NM_OPENCONNECT_HELPER_FD_ENV,
+	                                     nm_sprintf_buf (sbuf, "%d", tunnel->helper_child_fd),
+	                                     TRUE);
+	if (!g_spawn_async_with_pipes (NULL, (char **) tunnel->argv->pdata, openconnect_envp,
 	                               G_SPAWN_DO_NOT_REAP_CHILD,
-	                               openconnect_drop_child_privs, priv->tun_name,
-	                               &pid, &stdin_fd, NULL, NULL, error)) {
-		g_ptr_array_free (openconnect_argv, TRUE);
-		_LOGW ("openconnect failed to start.  error: '%s'", (*error)->message);
-		return -1;
+	                               openconnect_drop_child_privs, tunnel,
+	                               &pid, &tunnel->cookie_fd, NULL, NULL, error)) {
+		g_strfreev (openconnect_envp);
+		return FALSE;
 	}
-	g_ptr_array_free (openconnect_argv, TRUE);
+	g_strfreev (openconnect_envp);
 
 	_LOGI ("openconnect started with pid %d", pid);
+	tunnel_spawned (tunnel, pid);
+	return TRUE;
+}
+
+static void
+tunnel_launcher_done (GPid pid, gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+	GError *error = NULL;
 
-	if (write(stdin_fd, props_cookie, strlen(props_cookie)) != strlen(props_cookie) ||
-	    write(stdin_fd, "\n", 1) != 1) {
-		_LOGW ("openconnect didn't eat the cookie we fed it");
-		return -1;
+	tunnel->launch = NULL;
+	if (pid) {
+		_LOGI ("openconnect started with pid %d (pre-forked)", pid);
+		tunnel_spawned (tunnel, pid);
+	} else if (!tunnel_spawn_direct (tunnel, &error)) {
+		tunnel_connect_fail (tunnel, error);
+		return;
 	}
 
-	close(stdin_fd);
+	tunnel->connect_id = g_idle_add (tunnel_connect_cb, tunnel);
+}
 
-	NM_OPENCONNECT_PLUGIN_GET_PRIVATE (plugin)->pid = pid;
-	openconnect_watch = g_child_watch_source_new (pid);
-	g_source_set_callback (openconnect_watch, (GSourceFunc) openconnect_watch_cb, plugin, NULL);
-	g_source_attach (openconnect_watch, NULL);
-	g_source_unref (openconnect_watch);
+/* Starts openconnect, through the pre-forked launcher if there is one;
+ * the connect then resumes once it has answered. */
+static gboolean
+tunnel_connect_spawn (OpenconnectTunnel *tunnel, NMSettingVpn *s_vpn, GError **error)
+{
+	const char *props_cookie;
 
-	return 0;
+	props_cookie = nm_setting_vpn_get_secret (s_vpn, NM_OPENCONNECT_KEY_COOKIE);
+
+	if (tunnel->tun_name) {
+		g_ptr_array_add (tunnel->argv, g_strdup ("--interface"));
+		g_ptr_array_add (tunnel->argv, g_strdup (tunnel->tun_name));
+	}
+
+	g_ptr_array_add (tunnel->argv,
+	                 g_strdup (nm_setting_vpn_get_secret (s_vpn, NM_OPENCONNECT_KEY_GATEWAY)));
+
+	if (gl.log_level >= LOG_INFO) {
+		g_ptr_array_add (tunnel->argv, g_strdup ("--verbose"));
+		if (gl.log_level >= LOG_DEBUG)
+			g_ptr_array_add (tunnel->argv, g_strdup ("--verbose"));
+	}
+
+	g_ptr_array_add (tunnel->argv, NULL);
+
+	if (!tunnel_helper_open (tunnel, error))
+		return FALSE;
+
+	/* The launcher runs unprivileged, so only use it with a tun device */
+	if (tunnel->tun_name) {
+		tunnel->launch = launcher_exec_start ((const char *const *) tunnel->argv->pdata,
+		                                      props_cookie, tunnel->helper_child_fd,
+		                                      tunnel_launcher_done, tunnel);
+		if (tunnel->launch)
+			return TRUE;
+	}
+
+	return tunnel_spawn_direct (tunnel, error);
+}
+
+/* Writes without raising SIGPIPE if openconnect has gone away */
+static ssize_t
+write_nosigpipe (int fd, const void *buf, size_t len)
+{
+	static const struct timespec no_wait = { 0, 0 };
+	sigset_t pipe_mask, old_mask;
+	ssize_t n;
+	int errsv;
+
+	sigemptyset (&pipe_mask);
+	sigaddset (&pipe_mask, SIGPIPE);
+	sigprocmask (SIG_BLOCK, &pipe_mask, &old_mask);
+
+	n = write (fd, buf, len);
+	errsv = errno;
+	if (n < 0 && errsv == EPIPE)
+		sigtimedwait (&pipe_mask, NULL, &no_wait);
+
+	sigprocmask (SIG_SETMASK, &old_mask, NULL);
+	errno = errsv;
+	return n;
+}
+
+static void
+tunnel_connect_finish (OpenconnectTunnel *tunnel)
+{
+	nm_clear_g_source (&tunnel->connect_id);
+	if (tunnel->probe_cancellable) {
+		g_cancellable_cancel (tunnel->probe_cancellable);
+		g_clear_object (&tunnel->probe_cancellable);
+	}
+	if (tunnel->tun_cancellable) {
+		g_cancellable_cancel (tunnel->tun_cancellable);
+		g_clear_object (&tunnel->tun_cancellable);
+	}
+	if (tunnel->launch) {
+		launcher_exec_cancel (tunnel->launch);
+		tunnel->launch = NULL;
+	}
+	tunnel_cookie_clear (tunnel);
+	g_clear_object (&tunnel->connection);
+	if (tunnel->argv) {
+		g_ptr_array_free (tunnel->argv, TRUE);
+		tunnel->argv = NULL;
+	}
 }
+
+static void
+tunnel_connect_done (OpenconnectTunnel *tunnel)
+{
+	_LOGD ("connect took %" G_GINT64_FORMAT " ms",
+	       (g_get_monotonic_time () - tunnel->connect_start) / 1000);
+	tunnel_connect_finish (tunnel);
+}
+
+/* Takes @error. The tunnel must not be used after this returns. */
+static void
+tunnel_connect_fail (OpenconnectTunnel *tunnel, GError *error)
+{
+	NMVpnServicePlugin *plugin = NM_VPN_SERVICE_PLUGIN (tunnel->plugin);
+	NMOpenconnectPluginPrivate *priv = NM_OPENCONNECT_PLUGIN_GET_PRIVATE (plugin);
+
+	_LOGW ("openconnect failed to start.  error: '%s'", error->message);
+	g_error_free (error);
+	tunnel_connect_finish (tunnel);
+
+	/* A running child is killed, and its tunnel waits for the child
+	 * watch in priv->stopping; marked failed, so that the watch doesn't
+	 * report a second time. Either way the tunnel is out of the table
+	 * before the failure ends up in real_disconnect(). */
+	if (tunnel->watch_id) {
+		g_hash_table_steal (priv->tunnels, tunnel->uuid);
+		tunnel->state = OC_TUNNEL_STATE_FAILED;
+		priv->stopping = g_slist_prepend (priv->stopping, tunnel);
+		tunnel_signal (tunnel, SIGKILL);
+	} else
+		g_hash_table_remove (priv->tunnels, tunnel->uuid);
+	tunnel = NULL;
+
+	nm_vpn_service_plugin_failure (plugin, NM_VPN_PLUGIN_FAILURE_CONNECT_FAILED);
+}
+
+static gboolean
+tunnel_cookie_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+	ssize_t n;
+
+	n = write_nosigpipe (fd, tunnel->cookie + tunnel->cookie_written,
+	                     tunnel->cookie_len - tunnel->cookie_written);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return G_SOURCE_CONTINUE;
+	if (n <= 0) {
+		tunnel->cookie_watch_id = 0;
+		tunnel_connect_fail (tunnel,
+		                     g_error_new (NM_VPN_PLUGIN_ERROR,
+		                                  NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+		                                  _("openconnect didn't eat the cookie we fed it: %s"),
+		                                  g_strerror (errno)));
+		return G_SOURCE_REMOVE;
+	}
+
+	tunnel->cookie_written += n;
+	if (tunnel->cookie_written < tunnel->cookie_len)
+		return G_SOURCE_CONTINUE;
+
+	tunnel->cookie_watch_id = 0;
+	tunnel_connect_done (tunnel);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+tunnel_cookie_timeout_cb (gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+
+	tunnel->cookie_timeout_id = 0;
+	tunnel_connect_fail (tunnel,
+	                     g_error_new_literal (NM_VPN_PLUGIN_ERROR,
+	                                          NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+	                                          _("openconnect did not read the cookie in time.")));
+	return G_SOURCE_REMOVE;
+}
+
+/* Starts feeding the cookie to openconnect, unless the launcher already
+ * did. The pipe is written from the main loop as openconnect drains it,
+ * and a stuck child runs into the deadline. */
+static gboolean
+tunnel_connect_cookie (OpenconnectTunnel *tunnel, NMSettingVpn *s_vpn, GError **error)
+{
+	if (tunnel->cookie_fd < 0)
+		return TRUE;
+
+	tunnel->cookie = g_strconcat (nm_setting_vpn_get_secret (s_vpn, NM_OPENCONNECT_KEY_COOKIE),
+	                              "\n", NULL);
+	tunnel->cookie_len = strlen (tunnel->cookie);
+	tunnel->cookie_written = 0;
+
+	if (!g_unix_set_fd_nonblocking (tunnel->cookie_fd, TRUE, error))
+		return FALSE;
+
+	tunnel->cookie_watch_id = g_unix_fd_add (tunnel->cookie_fd, G_IO_OUT | G_IO_HUP | G_IO_ERR,
+	                                         tunnel_cookie_cb, tunnel);
+	tunnel->cookie_timeout_id = g_timeout_add_seconds (NM_OPENCONNECT_COOKIE_TIMEOUT,
+	                                                   tunnel_cookie_timeout_cb, tunnel);
+	return TRUE;
+}
+
+static gboolean
+tunnel_connect_cb (gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+	NMSettingVpn *s_vpn = nm_connection_get_setting_vpn (tunnel->connection);
+	OpenconnectConnectStage stage = tunnel->connect_stage;
+	GError *error = NULL;
+	gboolean success = FALSE;
+	gint64 start = g_get_monotonic_time ();
+
+	switch (stage) {
+	case OC_CONNECT_STAGE_BINARY:
+		success = tunnel_connect_binary (tunnel, s_vpn, &error);
+		break;
+	case OC_CONNECT_STAGE_TUNDEV:
+		success = tunnel_connect_tundev (tunnel, s_vpn, &error);
+		break;
+	case OC_CONNECT_STAGE_SPAWN:
+		success = tunnel_connect_spawn (tunnel, s_vpn, &error);
+		break;
+	case OC_CONNECT_STAGE_COOKIE:
+		success = tunnel_connect_cookie (tunnel, s_vpn, &error);
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+
+	_LOGD ("connect stage %s took %" G_GINT64_FORMAT " ms",
+	       connect_stage_names[stage], (g_get_monotonic_time () - start) / 1000);
+
+	if (!success) {
+		tunnel->connect_id = 0;
+		tunnel_connect_fail (tunnel, error);
+		return G_SOURCE_REMOVE;
+	}
+
+	/* Waiting for the binary to be probed; tunnel_binary_probed()
+	 * runs this stage again */
+	if (tunnel->probe_cancellable) {
+		tunnel->connect_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	tunnel->connect_stage++;
+
+	/* Waiting for a tun device or the launcher; tunnel_tundev_created()
+	 * or tunnel_launcher_done() resumes */
+	if (tunnel->tun_cancellable || tunnel->launch) {
+		tunnel->connect_id = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	if (tunnel->connect_stage < G_N_ELEMENTS (connect_stage_names))
+		return G_SOURCE_CONTINUE;
+
+	tunnel->connect_id = 0;
+	if (!tunnel->cookie_watch_id)
+		tunnel_connect_done (tunnel);
+	return G_SOURCE_REMOVE;
+}
+
 static gboolean
 real_connect (NMVpnServicePlugin   *plugin,
               NMConnection  *connection,
               GError       **error)
 {
+	NMOpenconnectPluginPrivate *priv = NM_OPENCONNECT_PLUGIN_GET_PRIVATE (plugin);
 	NMSettingVpn *s_vpn;
-	gint openconnect_fd = -1;
+	OpenconnectTunnel *tunnel;
+	const char *uuid;
+	const char *props_vpn_gw, *props_cookie;
 
 	s_vpn = nm_connection_get_setting_vpn (connection);
 	g_assert (s_vpn);
 	if (!nm_openconnect_properties_validate (s_vpn, error))
-		goto out;
+		return FALSE;
 	if (!nm_openconnect_secrets_validate (s_vpn, error))
-		goto out;
+		return FALSE;
+
+	/* The actual gateway to use (after redirection) comes from the auth
+	   dialog, so it's in the secrets hash not the properties */
+	props_vpn_gw = nm_setting_vpn_get_secret (s_vpn, NM_OPENCONNECT_KEY_GATEWAY);
+	if (!props_vpn_gw || !strlen (props_vpn_gw) ) {
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+		             "%s",
+		             _("No VPN gateway specified."));
+		return FALSE;
+	}
+
+	props_cookie = nm_setting_vpn_get_secret (s_vpn, NM_OPENCONNECT_KEY_COOKIE);
+	if (!props_cookie || !strlen (props_cookie)) {
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+		             "%s",
+		             _("No WebVPN cookie provided."));
+		return FALSE;
+	}
+
+	uuid = nm_connection_get_uuid (connection) ?: "";
+	if (g_hash_table_contains (priv->tunnels, uuid)) {
+		g_set_error (error,
+		             NM_VPN_PLUGIN_ERROR,
+		             NM_VPN_PLUGIN_ERROR_ALREADY_STARTED,
+		             _("Connection “%s” is already active."),
+		             uuid);
+		return FALSE;
+	}
 
 	if (_LOGD_enabled ())
 		nm_connection_dump (connection);
 
-	openconnect_fd = nm_openconnect_start_openconnect_binary (NM_OPENCONNECT_PLUGIN (plugin), s_vpn, error);
-	if (!openconnect_fd)
-		return TRUE;
+	tunnel = tunnel_new (NM_OPENCONNECT_PLUGIN (plugin), uuid);
+	g_hash_table_insert (priv->tunnels, tunnel->uuid, tunnel);
 
- out:
-	return FALSE;
+	tunnel->connection = g_object_ref (connection);
+	tunnel->connect_stage = OC_CONNECT_STAGE_BINARY;
+	tunnel->connect_start = g_get_monotonic_time ();
+	tunnel->connect_id = g_idle_add (tunnel_connect_cb, tunnel);
+	return TRUE;
 }
 
 static gboolean
@@ -586,13 +2693,37 @@ real_need_secrets (NMVpnServicePlugin *plugin,
 }
 
 static gboolean
-ensure_killed (gpointer data)
+tunnel_kill_cb (gpointer user_data)
+{
+	OpenconnectTunnel *tunnel = user_data;
+
+	tunnel->kill_id = 0;
+	_LOGW ("openconnect with PID %d did not exit within %d ms; killing it",
+	       tunnel->pid, gl.stop_timeout);
+	tunnel_signal (tunnel, SIGKILL);
+	return G_SOURCE_REMOVE;
+}
+
+/* Returns TRUE if the tunnel has nothing running and can be dropped */
+static gboolean
+tunnel_stop (OpenconnectTunnel *tunnel)
 {
-	int pid = GPOINTER_TO_INT (data);
+	if (!tunnel->pid) {
+		/* A connect that hasn't started openconnect yet is simply abandoned */
+		return TRUE;
+	}
 
-	if (kill (pid, 0) == 0)
-		kill (pid, SIGKILL);
+	tunnel_connect_finish (tunnel);
+
+	/* The timer belongs to the tunnel, which outlives the process */
+	tunnel->stop_start = g_get_monotonic_time ();
+	if (tunnel_signal (tunnel, SIGTERM) == 0)
+		tunnel->kill_id = g_timeout_add (gl.stop_timeout, tunnel_kill_cb, tunnel);
+	else
+		tunnel_signal (tunnel, SIGKILL);
 
+	_LOGI ("Terminated openconnect daemon with PID %d.", tunnel->pid);
+	tunnel->state = OC_TUNNEL_STATE_STOPPING;
 	return FALSE;
 }
 
@@ -601,15 +2732,18 @@ real_disconnect (NMVpnServicePlugin   *plugin,
                  GError       **err)
 {
 	NMOpenconnectPluginPrivate *priv = NM_OPENCONNECT_PLUGIN_GET_PRIVATE (plugin);
-
-	if (priv->pid) {
-		if (kill (priv->pid, SIGTERM) == 0)
-			g_timeout_add (2000, ensure_killed, GINT_TO_POINTER (priv->pid));
+	GHashTableIter iter;
+	OpenconnectTunnel *tunnel;
+
+	/* Tunnels with a child move to priv->stopping until their child
+	 * watch fires, so the connection can be started again right away */
+	g_hash_table_iter_init (&iter, priv->tunnels);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &tunnel)) {
+		g_hash_table_iter_steal (&iter);
+		if (tunnel_stop (tunnel))
+			tunnel_free (tunnel);
 		else
-			kill (priv->pid, SIGKILL);
-
-		_LOGI ("Terminated openconnect daemon with PID %d.", priv->pid);
-		priv->pid = 0;
+			priv->stopping = g_slist_prepend (priv->stopping, tunnel);
 	}
 
 	return TRUE;
@@ -618,6 +2752,22 @@ real_disconnect (NMVpnServicePlugin   *plugin,
 static void
 nm_openconnect_plugin_init (NMOpenconnectPlugin *plugin)
 {
+	NMOpenconnectPluginPrivate *priv = NM_OPENCONNECT_PLUGIN_GET_PRIVATE (plugin);
+
+	priv->tunnels = g_hash_table_new_full (g_str_hash, g_str_equal,
+	                                       NULL, (GDestroyNotify) tunnel_free);
+}
+
+static void
+dispose (GObject *object)
+{
+	NMOpenconnectPluginPrivate *priv = NM_OPENCONNECT_PLUGIN_GET_PRIVATE (object);
+
+	g_clear_pointer (&priv->tunnels, g_hash_table_unref);
+	g_slist_free_full (priv->stopping, (GDestroyNotify) tunnel_free);
+	priv->stopping = NULL;
+
+	G_OBJECT_CLASS (nm_openconnect_plugin_parent_class)->dispose (object);
 }
 
 static void
@@ -628,6 +2778,8 @@ nm_openconnect_plugin_class_init (NMOpenconnectPluginClass *openconnect_class)
 
 	g_type_class_add_private (object_class, sizeof (NMOpenconnectPluginPrivate));
 
+	object_class->dispose = dispose;
+
 	/* virtual methods */
 	parent_class->connect    = real_connect;
 	parent_class->need_secrets = real_need_secrets;
@@ -652,6 +2804,44 @@ nm_openconnect_plugin_new (const char *bus_name)
 	return plugin;
 }
 
+/* Activation time tracing. Phases are recorded from the start of main()
+ * on, before the log level is known, and logged once the main loop
+ * serves requests. */
+
+static void
+startup_mark (const char *phase)
+{
+	if (gl.startup_n < G_N_ELEMENTS (gl.startup)) {
+		gl.startup[gl.startup_n].phase = phase;
+		gl.startup[gl.startup_n].time = g_get_monotonic_time ();
+		gl.startup_n++;
+	}
+}
+
+static gboolean
+startup_ready_cb (gpointer user_data)
+{
+	GString *record;
+	guint i;
+
+	startup_mark ("ready");
+
+	if (!_LOGD_enabled ())
+		return G_SOURCE_REMOVE;
+
+	record = g_string_new (NULL);
+	for (i = 1; i < gl.startup_n; i++) {
+		_LOGD ("startup: %s took %" G_GINT64_FORMAT " us",
+		       gl.startup[i].phase, gl.startup[i].time - gl.startup[i - 1].time);
+		g_string_append_printf (record, "%s=%" G_GINT64_FORMAT " ",
+		                        gl.startup[i].phase, gl.startup[i].time - gl.startup[i - 1].time);
+	}
+	_LOGD ("startup: %stotal=%" G_GINT64_FORMAT,
+	       record->str, gl.startup[gl.startup_n - 1].time - gl.startup[0].time);
+	g_string_free (record, TRUE);
+	return G_SOURCE_REMOVE;
+}
+
 static void
 signal_handler (int signo)
 {
@@ -682,28 +2872,38 @@ quit_mainloop (NMOpenconnectPlugin *plugin, gpointer user_data)
 int main (int argc, char *argv[])
 {
 	NMOpenconnectPlugin *plugin;
-	gboolean persist = FALSE;
 	GOptionContext *opt_ctx = NULL;
 	gchar *bus_name = NM_DBUS_SERVICE_OPENCONNECT;
 	char sbuf[30];
 
 	GOptionEntry options[] = {
-		{ "persist", 0, 0, G_OPTION_ARG_NONE, &persist, N_("Don’t quit when VPN connection terminates"), NULL },
+		{ "persist", 0, 0, G_OPTION_ARG_NONE, &gl.persist, N_("Don’t quit when VPN connection terminates"), NULL },
 		{ "debug", 0, 0, G_OPTION_ARG_NONE, &gl.debug, N_("Enable verbose debug logging (may expose passwords)"), NULL },
 		{ "bus-name", 0, 0, G_OPTION_ARG_STRING, &bus_name, N_("D-Bus name to use for this instance"), NULL },
+		{ "prefork", 0, 0, G_OPTION_ARG_NONE, &gl.prefork, N_("Keep a pre-forked launcher ready to start openconnect"), NULL },
+		{ "stop-timeout", 0, 0, G_OPTION_ARG_INT, &gl.stop_timeout, N_("Milliseconds openconnect gets to exit before it is killed"), "MS" },
+		/* For running against a stub openconnect in tests */
+		{ "openconnect", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_FILENAME, &gl.openconnect_path, NULL, NULL },
+		{ "helper", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_FILENAME, &gl.helper_path, NULL, NULL },
+		{ "no-tundev", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &gl.no_tundev, NULL, NULL },
 		{NULL}
 	};
 
+	startup_mark ("start");
+
 #if !GLIB_CHECK_VERSION (2, 35, 0)
 	g_type_init ();
 #endif
 
+	gl.stop_timeout = NM_OPENCONNECT_STOP_TIMEOUT;
+
 	/* locale will be set according to environment LC_* variables */
 	setlocale (LC_ALL, "");
 
 	bindtextdomain (GETTEXT_PACKAGE, NM_OPENCONNECT_LOCALEDIR);
 	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
 	textdomain (GETTEXT_PACKAGE);
+	startup_mark ("locale");
 
 	/* Parse options */
 	opt_ctx = g_option_context_new (NULL);
@@ -718,6 +2918,10 @@ int main (int argc, char *argv[])
 
 	g_option_context_parse (opt_ctx, &argc, &argv, NULL);
 	g_option_context_free (opt_ctx);
+	startup_mark ("options");
+
+	if (gl.stop_timeout <= 0)
+		gl.stop_timeout = NM_OPENCONNECT_STOP_TIMEOUT;
 
 	if (getenv ("OPENCONNECT_DEBUG"))
 		gl.debug = TRUE;
@@ -732,26 +2936,36 @@ int main (int argc, char *argv[])
 
 	_LOGD ("nm-openconnect-service (version " DIST_VERSION ") starting...");
 
-	if (system ("/sbin/modprobe tun") == -1)
-		exit (EXIT_FAILURE);
-
 	if (bus_name)
 		setenv ("NM_DBUS_SERVICE_OPENCONNECT", bus_name, 0);
 
 	plugin = nm_openconnect_plugin_new (bus_name);
 	if (!plugin)
 		exit (EXIT_FAILURE);
+	startup_mark ("plugin");
 
 	gl.loop = g_main_loop_new (NULL, FALSE);
 
-	if (!persist)
+	if (!gl.persist)
 		g_signal_connect (plugin, "quit", G_CALLBACK (quit_mainloop), gl.loop);
 
+	/* Have a tun device ready by the time the connect comes */
+	gl.have_tun_owner = !gl.no_tundev && tun_owner_lookup ();
+	tun_pool_schedule_refill ();
+	launcher_schedule_spawn ();
+	g_idle_add_full (G_PRIORITY_HIGH_IDLE, startup_ready_cb, NULL, NULL);
+
 	setup_signals ();
 	g_main_loop_run (gl.loop);
 
 	g_clear_pointer (&gl.loop, g_main_loop_unref);
 	g_object_unref (plugin);
 
+	tun_pool_drain ();
+	launcher_stop ();
+	g_clear_pointer (&gl.binary, openconnect_binary_free);
+	g_free (gl.openconnect_path);
+	g_free (gl.helper_path);
+
 	exit (EXIT_SUCCESS);
 }
@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* libFuzzer target for the list tokenizer of nm-openconnect-config.c and
+ * the converters built on it, which take whatever the server sends.
+ * Built with --enable-fuzzing only. */
+
+#include "nm-openconnect-config.c"
+
+int LLVMFuzzerTestOneInput (const guint8 *data, size_t size);
+
+static void
+value_drop (GVariant *value)
+{
+	if (value)
+		g_variant_unref (g_variant_ref_sink (value));
+}
+
+int
+LLVMFuzzerTestOneInput (const guint8 *data, size_t size)
+{
+	char *str = g_strndup ((const char *) data, size);
+	const char *end = str + strlen (str);
+	const char *p = str;
+	const char *token;
+	gsize len;
+
+	while (list_next_token (&p, ", ", &token, &len)) {
+		g_assert (len > 0);
+		g_assert (token >= str && token + len <= end);
+		g_assert (p == token + len);
+	}
+
+	value_drop (split_dns_list_to_gvariant (str, NULL));
+	value_drop (addr4_list_to_gvariant (str, NULL));
+	value_drop (addr6_list_to_gvariant (str, NULL));
+
+	g_free (str);
+	return 0;
+}
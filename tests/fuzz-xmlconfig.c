@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* libFuzzer target for the XML profile reader of the auth dialog; the
+ * profile comes from the server. Built with --enable-fuzzing only. */
+
+#include "nm-default.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libxml/parser.h>
+#include <libxml/xmlreader.h>
+
+#include "xmlconfig.c"
+
+int LLVMFuzzerTestOneInput (const guint8 *data, size_t size);
+
+static void
+xml_error_ignore (void *ctx, const char *msg, ...)
+{
+}
+
+int
+LLVMFuzzerTestOneInput (const guint8 *data, size_t size)
+{
+	static gboolean initialized;
+	vpnhost *hosts, *host;
+
+	if (!initialized) {
+		xmlSetGenericErrorFunc (NULL, xml_error_ignore);
+		initialized = TRUE;
+	}
+
+	hosts = parse_xmlconfig ((const char *) data, size);
+	for (host = hosts; host; host = host->next)
+		g_assert (host->hostname && host->hostaddress);
+	free_vpnhosts (hosts);
+	return 0;
+}
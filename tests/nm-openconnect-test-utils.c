@@ -0,0 +1,276 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Runs nm-openconnect-service against a private dbus-daemon, standing
+ * in for the system bus, and the stub openconnect next to this file. */
+
+#include "nm-default.h"
+
+#include "nm-openconnect-test-utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "nm-utils/nm-shared-utils.h"
+
+/*****************************************************************************/
+
+static void
+child_reap (GPid pid)
+{
+	kill (pid, SIGTERM);
+	while (waitpid (pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	g_spawn_close_pid (pid);
+}
+
+/* dbus-daemon prints its address on a line of its own once it listens */
+static char *
+address_read (int fd)
+{
+	GString *line = g_string_new (NULL);
+	char c;
+	ssize_t n;
+
+	for (;;) {
+		n = read (fd, &c, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || c == '\n')
+			break;
+		g_string_append_c (line, c);
+	}
+
+	if (n <= 0 || !line->len) {
+		g_string_free (line, TRUE);
+		return NULL;
+	}
+	return g_string_free (line, FALSE);
+}
+
+/* Returns NULL if there is no dbus-daemon to run; the test is skipped then */
+TestBus *
+test_bus_start (void)
+{
+	char *argv[] = { NULL, "--session", "--nofork", "--print-address", NULL };
+	GError *error = NULL;
+	TestBus *bus;
+	int out_fd;
+
+	argv[0] = g_find_program_in_path ("dbus-daemon");
+	if (!argv[0]) {
+		g_print ("dbus-daemon not found, skipping\n");
+		return NULL;
+	}
+
+	bus = g_slice_new0 (TestBus);
+	if (!g_spawn_async_with_pipes (NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+	                               NULL, NULL, &bus->pid, NULL, &out_fd, NULL, &error))
+		g_error ("Could not start dbus-daemon: %s", error->message);
+	g_free (argv[0]);
+
+	bus->address = address_read (out_fd);
+	close (out_fd);
+	if (!bus->address)
+		g_error ("dbus-daemon did not tell its address");
+
+	bus->connection = g_dbus_connection_new_for_address_sync (bus->address,
+	                                                          G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT
+	                                                          | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+	                                                          NULL, NULL, &error);
+	if (!bus->connection)
+		g_error ("Could not connect to %s: %s", bus->address, error->message);
+	g_dbus_connection_set_exit_on_close (bus->connection, FALSE);
+
+	return bus;
+}
+
+void
+test_bus_stop (TestBus *bus)
+{
+	g_dbus_connection_close_sync (bus->connection, NULL, NULL);
+	g_object_unref (bus->connection);
+	child_reap (bus->pid);
+	g_free (bus->address);
+	g_slice_free (TestBus, bus);
+}
+
+/*****************************************************************************/
+
+/* The service doesn't create tun devices of its own, as that needs
+ * CAP_NET_ADMIN wherever the nm-openconnect user exists. The stub has
+ * no use for one anyway. */
+GPid
+test_service_spawn (TestBus *bus)
+{
+	char *argv[] = {
+		TEST_TOP_BUILDDIR "/src/nm-openconnect-service",
+		"--persist",
+		"--no-tundev",
+		"--openconnect", TEST_SRCDIR "/openconnect-stub",
+		"--helper", TEST_TOP_BUILDDIR "/src/nm-openconnect-service-openconnect-helper",
+		NULL
+	};
+	GError *error = NULL;
+	char **envp;
+	GPid pid;
+
+	envp = g_environ_setenv (g_get_environ (), "DBUS_SYSTEM_BUS_ADDRESS", bus->address, TRUE);
+	if (!g_spawn_async (NULL, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD,
+	                    NULL, NULL, &pid, &error))
+		g_error ("Could not start nm-openconnect-service: %s", error->message);
+	g_strfreev (envp);
+	return pid;
+}
+
+static void
+name_appeared_cb (GDBusConnection *connection,
+                  const char *name,
+                  const char *name_owner,
+                  gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+}
+
+static void
+name_vanished_cb (GDBusConnection *connection,
+                  const char *name,
+                  gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+}
+
+static gboolean
+name_wait (TestBus *bus, gboolean owned)
+{
+	gboolean done = FALSE;
+	guint watch_id;
+
+	watch_id = g_bus_watch_name_on_connection (bus->connection,
+	                                           NM_DBUS_SERVICE_OPENCONNECT,
+	                                           G_BUS_NAME_WATCHER_FLAGS_NONE,
+	                                           owned ? name_appeared_cb : NULL,
+	                                           owned ? NULL : name_vanished_cb,
+	                                           &done,
+	                                           NULL);
+	test_wait_until (&done, TEST_TIMEOUT_MS);
+	g_bus_unwatch_name (watch_id);
+	return done;
+}
+
+/* The service takes its bus name before it enters the main loop, so it
+ * only counts as ready once it answers a call. */
+gboolean
+test_service_wait_ready (TestBus *bus)
+{
+	GVariant *ret;
+
+	if (!name_wait (bus, TRUE))
+		return FALSE;
+
+	ret = g_dbus_connection_call_sync (bus->connection,
+	                                   NM_DBUS_SERVICE_OPENCONNECT,
+	                                   NM_VPN_DBUS_PLUGIN_PATH,
+	                                   "org.freedesktop.DBus.Properties",
+	                                   "Get",
+	                                   g_variant_new ("(ss)", NM_VPN_DBUS_PLUGIN_INTERFACE, "State"),
+	                                   G_VARIANT_TYPE ("(v)"),
+	                                   G_DBUS_CALL_FLAGS_NONE,
+	                                   TEST_TIMEOUT_MS,
+	                                   NULL,
+	                                   NULL);
+	if (!ret)
+		return FALSE;
+	g_variant_unref (ret);
+	return TRUE;
+}
+
+/* Also waits for the bus to let go of the name, so that the next
+ * service started can be told apart from this one */
+void
+test_service_stop (TestBus *bus, GPid pid)
+{
+	child_reap (pid);
+	if (!name_wait (bus, FALSE))
+		g_error ("%s is still owned", NM_DBUS_SERVICE_OPENCONNECT);
+}
+
+/*****************************************************************************/
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+/* Runs the main context until @condition is set or time runs out */
+gboolean
+test_wait_until (gboolean *condition, guint timeout_ms)
+{
+	gboolean timed_out = FALSE;
+	guint timeout_id;
+
+	timeout_id = g_timeout_add (timeout_ms, timeout_cb, &timed_out);
+	while (!*condition && !timed_out)
+		g_main_context_iteration (NULL, TRUE);
+	if (!timed_out)
+		g_source_remove (timeout_id);
+	return *condition;
+}
+
+/*****************************************************************************/
+
+guint
+test_iterations (guint fallback)
+{
+	return _nm_utils_ascii_str_to_int64 (getenv ("NM_OPENCONNECT_TEST_ITERATIONS"),
+	                                     10, 1, G_MAXINT, fallback);
+}
+
+static int
+sample_cmp (gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* @samples are in microseconds; sorted in place */
+void
+test_report_latency (const char *what, GArray *samples)
+{
+	const gint64 *s;
+	guint n = samples->len;
+
+	if (!n)
+		return;
+
+	g_array_sort (samples, sample_cmp);
+	s = (const gint64 *) samples->data;
+	g_print ("%s: n=%u min=%.2f p50=%.2f p99=%.2f max=%.2f ms\n",
+	         what, n,
+	         s[0] / 1000.0,
+	         s[(n - 1) * 50 / 100] / 1000.0,
+	         s[(n - 1) * 99 / 100] / 1000.0,
+	         s[n - 1] / 1000.0);
+}
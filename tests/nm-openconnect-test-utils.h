@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __NM_OPENCONNECT_TEST_UTILS_H__
+#define __NM_OPENCONNECT_TEST_UTILS_H__
+
+/* What automake's test driver counts as a skipped test */
+#define TEST_EXIT_SKIP 77
+
+/* Upper bound for anything the tests wait for */
+#define TEST_TIMEOUT_MS 10000
+
+typedef struct {
+	GPid pid;
+	char *address;
+	GDBusConnection *connection;
+} TestBus;
+
+TestBus *test_bus_start (void);
+void test_bus_stop (TestBus *bus);
+
+GPid test_service_spawn (TestBus *bus);
+gboolean test_service_wait_ready (TestBus *bus);
+void test_service_stop (TestBus *bus, GPid pid);
+
+gboolean test_wait_until (gboolean *condition, guint timeout_ms);
+
+guint test_iterations (guint fallback);
+void test_report_latency (const char *what, GArray *samples);
+
+#endif /* __NM_OPENCONNECT_TEST_UTILS_H__ */
@@ -0,0 +1,363 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The list tokenizer of nm-openconnect-config.c, and the converters built
+ * on it. The file is included so that its static functions can be reached.
+ * NM_OPENCONNECT_TEST_ITERATIONS sets the number of benchmark runs. */
+
+#include "nm-openconnect-config.c"
+
+#include "nm-openconnect-test-utils.h"
+
+/*****************************************************************************/
+
+static void
+assert_tokens (const char *str, const char *delims, const char *const *expected)
+{
+	const char *p = str;
+	const char *token;
+	gsize len;
+	guint i = 0;
+
+	while (list_next_token (&p, delims, &token, &len)) {
+		g_assert (expected[i]);
+		g_assert_cmpuint (len, ==, strlen (expected[i]));
+		g_assert (!strncmp (token, expected[i], len));
+		/* Nothing is copied */
+		g_assert (token >= str && token + len <= str + strlen (str));
+		g_assert (p == token + len);
+		i++;
+	}
+	g_assert (!expected[i]);
+}
+
+static void
+test_next_token (void)
+{
+	assert_tokens ("", " ", (const char *[]) { NULL });
+	assert_tokens ("   ", " ", (const char *[]) { NULL });
+	assert_tokens ("a", " ", (const char *[]) { "a", NULL });
+	assert_tokens ("a b", " ", (const char *[]) { "a", "b", NULL });
+	assert_tokens ("  a   b  ", " ", (const char *[]) { "a", "b", NULL });
+	assert_tokens ("a,b, c,,  d", ", ", (const char *[]) { "a", "b", "c", "d", NULL });
+	assert_tokens ("a,b", " ", (const char *[]) { "a,b", NULL });
+}
+
+static void
+test_token_to_addr (void)
+{
+	const char *list = "192.0.2.1 2001:db8::1";
+	struct in6_addr addr6;
+	struct in_addr addr4;
+	char *long_token;
+
+	/* Tokens are not NUL-terminated */
+	g_assert (list_token_to_addr (AF_INET, list, 9, &addr4));
+	g_assert_cmpuint (addr4.s_addr, ==, htonl (0xc0000201));
+	g_assert (!list_token_to_addr (AF_INET, list, 7, &addr4));
+	g_assert (list_token_to_addr (AF_INET6, list + 10, 11, &addr6));
+	g_assert_cmpuint (addr6.s6_addr[0], ==, 0x20);
+	g_assert_cmpuint (addr6.s6_addr[15], ==, 0x01);
+
+	g_assert (!list_token_to_addr (AF_INET, list + 10, 11, &addr4));
+	g_assert (!list_token_to_addr (AF_INET6, list, 9, &addr6));
+	g_assert (!list_token_to_addr (AF_INET, "", 0, &addr4));
+
+	/* Longer than any address; must not overrun the buffer */
+	long_token = g_strnfill (INET6_ADDRSTRLEN + 10, '1');
+	g_assert (!list_token_to_addr (AF_INET6, long_token, strlen (long_token), &addr6));
+	g_assert (!list_token_to_addr (AF_INET6, long_token, INET6_ADDRSTRLEN, &addr6));
+	g_free (long_token);
+}
+
+/*****************************************************************************/
+
+static void
+test_addr4_list (void)
+{
+	GVariant *value;
+
+	g_assert (!addr4_list_to_gvariant (NULL, NULL));
+	g_assert (!addr4_list_to_gvariant ("", NULL));
+	g_assert (!addr4_list_to_gvariant ("   ", NULL));
+	g_assert (!addr4_list_to_gvariant ("192.0.2.1 bogus", NULL));
+
+	value = g_variant_ref_sink (addr4_list_to_gvariant ("  192.0.2.1   192.0.2.2 ", NULL));
+	g_assert (value);
+	g_assert_cmpuint (g_variant_n_children (value), ==, 2);
+	g_variant_unref (value);
+}
+
+static void
+test_addr6_list (void)
+{
+	GVariant *value;
+
+	g_assert (!addr6_list_to_gvariant ("", NULL));
+	g_assert (!addr6_list_to_gvariant ("2001:db8::1 192.0.2.1", NULL));
+
+	value = g_variant_ref_sink (addr6_list_to_gvariant ("2001:db8::1 2001:db8::2", NULL));
+	g_assert (value);
+	g_assert_cmpuint (g_variant_n_children (value), ==, 2);
+	g_variant_unref (value);
+}
+
+static void
+test_split_dns_list (void)
+{
+	const char **domains;
+	GVariant *value;
+	GString *str;
+	char *long_domain;
+	gsize n;
+
+	g_assert (!split_dns_list_to_gvariant (NULL, NULL));
+	g_assert (!split_dns_list_to_gvariant (" , ", NULL));
+	g_assert (!split_dns_list_to_gvariant ("example.com \xff", NULL));
+
+	value = g_variant_ref_sink (split_dns_list_to_gvariant ("example.com, example.net,,corp", NULL));
+	domains = g_variant_get_strv (value, &n);
+	g_assert_cmpuint (n, ==, 3);
+	g_assert_cmpstr (domains[0], ==, "example.com");
+	g_assert_cmpstr (domains[1], ==, "example.net");
+	g_assert_cmpstr (domains[2], ==, "corp");
+	g_free (domains);
+	g_variant_unref (value);
+
+	/* Too long for the stack buffer, but still passed on */
+	long_domain = g_strnfill (300, 'x');
+	str = g_string_new ("a ");
+	g_string_append (str, long_domain);
+	value = g_variant_ref_sink (split_dns_list_to_gvariant (str->str, NULL));
+	domains = g_variant_get_strv (value, &n);
+	g_assert_cmpuint (n, ==, 2);
+	g_assert_cmpstr (domains[0], ==, "a");
+	g_assert_cmpstr (domains[1], ==, long_domain);
+	g_free (domains);
+	g_variant_unref (value);
+	g_string_free (str, TRUE);
+	g_free (long_domain);
+}
+
+/*****************************************************************************/
+
+#define MAX_ROUTES 8
+
+static const struct {
+	const char *name;
+	int family;
+	const char *in[MAX_ROUTES];
+	const char *out[MAX_ROUTES]; /* sorted */
+} coalesce_tests[] = {
+	{ "empty", AF_INET,
+	  { NULL },
+	  { NULL } },
+	{ "adjacent /25 pair", AF_INET,
+	  { "10.0.0.128/25", "10.0.0.0/25" },
+	  { "10.0.0.0/24" } },
+	{ "merges cascade", AF_INET,
+	  { "10.0.0.0/25", "10.0.1.0/24", "10.0.0.128/25" },
+	  { "10.0.0.0/23" } },
+	{ "adjacent but not siblings", AF_INET,
+	  { "10.0.1.0/24", "10.0.2.0/24" },
+	  { "10.0.1.0/24", "10.0.2.0/24" } },
+	{ "neighbours of different length", AF_INET,
+	  { "10.0.0.0/24", "10.0.1.0/25" },
+	  { "10.0.0.0/24", "10.0.1.0/25" } },
+	{ "nested", AF_INET,
+	  { "10.1.2.0/24", "10.0.0.0/8", "10.1.2.3/32" },
+	  { "10.0.0.0/8" } },
+	{ "nested sibling", AF_INET,
+	  { "10.0.0.0/24", "10.0.0.0/25", "10.0.1.0/24" },
+	  { "10.0.0.0/23" } },
+	{ "duplicates", AF_INET,
+	  { "192.0.2.0/24", "192.0.2.0/24", "192.0.2.0/24" },
+	  { "192.0.2.0/24" } },
+	{ "host bits cleared", AF_INET,
+	  { "192.0.2.77/24", "192.0.2.0/24" },
+	  { "192.0.2.0/24" } },
+	{ "/0 covers everything", AF_INET,
+	  { "10.0.0.0/8", "0.0.0.0/0", "192.0.2.1/32" },
+	  { "0.0.0.0/0" } },
+	{ "halves make /0", AF_INET,
+	  { "128.0.0.0/1", "0.0.0.0/1" },
+	  { "0.0.0.0/0" } },
+	{ "/32 siblings", AF_INET,
+	  { "192.0.2.1/32", "192.0.2.0/32" },
+	  { "192.0.2.0/31" } },
+	{ "/32 non-siblings", AF_INET,
+	  { "192.0.2.2/32", "192.0.2.1/32" },
+	  { "192.0.2.1/32", "192.0.2.2/32" } },
+	{ "IPv6 siblings", AF_INET6,
+	  { "2001:db8:8000::/33", "2001:db8::/33" },
+	  { "2001:db8::/32" } },
+	{ "IPv6 nested", AF_INET6,
+	  { "2001:db8:1::/48", "2001:db8::/32", "2001:db8:1::/48" },
+	  { "2001:db8::/32" } },
+	{ "IPv6 unmergeable", AF_INET6,
+	  { "2001:db8:1::/48", "2001:db8:2::/48" },
+	  { "2001:db8:1::/48", "2001:db8:2::/48" } },
+	{ "/128 siblings", AF_INET6,
+	  { "2001:db8::1/128", "2001:db8::/128" },
+	  { "2001:db8::/127" } },
+	{ "/128 non-siblings", AF_INET6,
+	  { "2001:db8::2/128", "2001:db8::1/128" },
+	  { "2001:db8::1/128", "2001:db8::2/128" } },
+	{ "::/0 covers everything", AF_INET6,
+	  { "2001:db8::/32", "::/0" },
+	  { "::/0" } },
+};
+
+static void
+route_add_str (GArray *routes, int family, const char *str)
+{
+	guint8 addr[16];
+	char **parts;
+
+	parts = g_strsplit (str, "/", 2);
+	g_assert (parts[1]);
+	g_assert (inet_pton (family, parts[0], addr) > 0);
+	route_add (routes, addr, family == AF_INET ? 4 : 16, atoi (parts[1]));
+	g_strfreev (parts);
+}
+
+static void
+test_routes_coalesce (void)
+{
+	char buf[INET6_ADDRSTRLEN];
+	GArray *routes;
+	char *str;
+	guint i, j, n;
+
+	for (i = 0; i < G_N_ELEMENTS (coalesce_tests); i++) {
+		routes = g_array_new (FALSE, FALSE, sizeof (ConfigRoute));
+		for (j = 0; coalesce_tests[i].in[j]; j++)
+			route_add_str (routes, coalesce_tests[i].family, coalesce_tests[i].in[j]);
+
+		routes_coalesce (routes);
+
+		for (n = 0; coalesce_tests[i].out[n]; n++)
+			;
+		if (routes->len != n)
+			g_error ("%s: %u routes, expected %u", coalesce_tests[i].name, routes->len, n);
+		for (j = 0; j < n; j++) {
+			const ConfigRoute *r = &g_array_index (routes, ConfigRoute, j);
+
+			inet_ntop (coalesce_tests[i].family, r->addr, buf, sizeof (buf));
+			str = g_strdup_printf ("%s/%u", buf, r->plen);
+			if (strcmp (str, coalesce_tests[i].out[j]))
+				g_error ("%s: route %u is %s, expected %s",
+				         coalesce_tests[i].name, j, str, coalesce_tests[i].out[j]);
+			g_free (str);
+		}
+		g_array_unref (routes);
+	}
+}
+
+/*****************************************************************************/
+
+#define BENCH_ROUTES4  4000
+#define BENCH_ROUTES6  1000
+#define BENCH_DOMAINS  2000
+
+/* What a server with a long split-include list hands openconnect */
+static char **
+bench_env_new (void)
+{
+	GPtrArray *env = g_ptr_array_new ();
+	GString *domains = g_string_new ("CISCO_SPLIT_DNS=");
+	guint i;
+
+	g_ptr_array_add (env, g_strdup ("VPNGATEWAY=192.0.2.1"));
+	g_ptr_array_add (env, g_strdup ("TUNDEV=vpn0"));
+	g_ptr_array_add (env, g_strdup ("INTERNAL_IP4_ADDRESS=198.51.100.2"));
+	g_ptr_array_add (env, g_strdup ("INTERNAL_IP6_ADDRESS=2001:db8::2"));
+
+	/* Every other /24, so that they don't all coalesce into one */
+	g_ptr_array_add (env, g_strdup_printf ("CISCO_SPLIT_INC=%u", BENCH_ROUTES4));
+	for (i = 0; i < BENCH_ROUTES4; i++) {
+		g_ptr_array_add (env, g_strdup_printf ("CISCO_SPLIT_INC_%u_ADDR=10.%u.%u.0",
+		                                       i, i >> 7, (i & 127) * 2));
+		g_ptr_array_add (env, g_strdup_printf ("CISCO_SPLIT_INC_%u_MASKLEN=24", i));
+	}
+
+	g_ptr_array_add (env, g_strdup_printf ("CISCO_IPV6_SPLIT_INC=%u", BENCH_ROUTES6));
+	for (i = 0; i < BENCH_ROUTES6; i++) {
+		g_ptr_array_add (env, g_strdup_printf ("CISCO_IPV6_SPLIT_INC_%u_ADDR=2001:db8:%x::",
+		                                       i, i * 2));
+		g_ptr_array_add (env, g_strdup_printf ("CISCO_IPV6_SPLIT_INC_%u_MASKLEN=48", i));
+	}
+
+	for (i = 0; i < BENCH_DOMAINS; i++)
+		g_string_append_printf (domains, "%sd%u.example.com", i ? ", " : "", i);
+	g_ptr_array_add (env, g_string_free (domains, FALSE));
+
+	g_ptr_array_add (env, NULL);
+	return (char **) g_ptr_array_free (env, FALSE);
+}
+
+static void
+test_bench_env (void)
+{
+	GVariant *config, *ip4config, *ip6config;
+	const char *failure;
+	GArray *samples;
+	gint64 start, elapsed;
+	char **envp;
+	guint i, n;
+
+	envp = bench_env_new ();
+	samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+	n = test_iterations (20);
+	for (i = 0; i < n; i++) {
+		start = g_get_monotonic_time ();
+		g_assert (nm_openconnect_config_from_env ((const char *const *) envp,
+		                                          &config, &ip4config, &ip6config, &failure));
+		elapsed = g_get_monotonic_time () - start;
+		g_array_append_val (samples, elapsed);
+
+		g_assert (ip4config && ip6config);
+		g_variant_unref (config);
+		g_variant_unref (ip4config);
+		g_variant_unref (ip6config);
+	}
+
+	test_report_latency ("split env", samples);
+
+	g_array_unref (samples);
+	g_strfreev (envp);
+}
+
+/*****************************************************************************/
+
+int
+main (int argc, char *argv[])
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/config/list/next-token", test_next_token);
+	g_test_add_func ("/config/list/token-to-addr", test_token_to_addr);
+	g_test_add_func ("/config/list/addr4", test_addr4_list);
+	g_test_add_func ("/config/list/addr6", test_addr6_list);
+	g_test_add_func ("/config/list/split-dns", test_split_dns_list);
+	g_test_add_func ("/config/routes/coalesce", test_routes_coalesce);
+	g_test_add_func ("/config/list/bench-env", test_bench_env);
+
+	return g_test_run ();
+}
@@ -0,0 +1,205 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Runs nm-openconnect-service-openconnect-helper the way openconnect
+ * does, without the channel to the service, so that it takes the D-Bus
+ * path, and reports its wall-clock time per run. The test itself plays
+ * the VPN plugin on the private bus and takes the configuration calls.
+ * NM_OPENCONNECT_TEST_ITERATIONS sets the number of runs. */
+
+#include "nm-default.h"
+
+#include "nm-openconnect-test-utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "nm-openconnect-config.h"
+
+static const char plugin_xml[] =
+	"<node>"
+	"  <interface name='" NM_VPN_DBUS_PLUGIN_INTERFACE "'>"
+	"    <method name='SetConfig'><arg name='config' type='a{sv}' direction='in'/></method>"
+	"    <method name='SetIp4Config'><arg name='config' type='a{sv}' direction='in'/></method>"
+	"    <method name='SetIp6Config'><arg name='config' type='a{sv}' direction='in'/></method>"
+	"    <method name='SetFailure'><arg name='reason' type='s' direction='in'/></method>"
+	"  </interface>"
+	"</node>";
+
+typedef struct {
+	guint config;
+	guint ip4config;
+	guint failure;
+	gboolean exited;
+	int status;
+} HelperRun;
+
+static void
+plugin_method_cb (GDBusConnection *connection,
+                  const char *sender,
+                  const char *object_path,
+                  const char *interface_name,
+                  const char *method_name,
+                  GVariant *parameters,
+                  GDBusMethodInvocation *invocation,
+                  gpointer user_data)
+{
+	HelperRun *run = *(HelperRun **) user_data;
+
+	if (!run) {
+		g_dbus_method_invocation_return_dbus_error (invocation,
+		                                            "org.freedesktop.DBus.Error.Failed",
+		                                            "No helper run in progress");
+		return;
+	}
+
+	if (!strcmp (method_name, "SetConfig"))
+		run->config++;
+	else if (!strcmp (method_name, "SetIp4Config"))
+		run->ip4config++;
+	else if (!strcmp (method_name, "SetFailure"))
+		run->failure++;
+	g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+static const GDBusInterfaceVTable plugin_vtable = {
+	plugin_method_cb,
+};
+
+static void
+name_acquired_cb (GDBusConnection *connection, const char *name, gpointer user_data)
+{
+	*(gboolean *) user_data = TRUE;
+}
+
+static void
+helper_exited_cb (GPid pid, gint status, gpointer user_data)
+{
+	HelperRun *run = user_data;
+
+	run->status = status;
+	run->exited = TRUE;
+	g_spawn_close_pid (pid);
+}
+
+static char **
+helper_environ (TestBus *bus)
+{
+	char **envp = g_get_environ ();
+
+	envp = g_environ_unsetenv (envp, NM_OPENCONNECT_HELPER_FD_ENV);
+	envp = g_environ_setenv (envp, "DBUS_SYSTEM_BUS_ADDRESS", bus->address, TRUE);
+	envp = g_environ_setenv (envp, "reason", "connect", TRUE);
+	envp = g_environ_setenv (envp, "TUNDEV", "stub0", TRUE);
+	envp = g_environ_setenv (envp, "VPNGATEWAY", "192.0.2.1", TRUE);
+	envp = g_environ_setenv (envp, "INTERNAL_IP4_ADDRESS", "198.51.100.2", TRUE);
+	envp = g_environ_setenv (envp, "INTERNAL_IP4_NETMASK", "255.255.255.0", TRUE);
+	envp = g_environ_setenv (envp, "INTERNAL_IP4_DNS", "198.51.100.53", TRUE);
+	envp = g_environ_setenv (envp, "CISCO_SPLIT_INC", "1", TRUE);
+	envp = g_environ_setenv (envp, "CISCO_SPLIT_INC_0_ADDR", "203.0.113.0", TRUE);
+	envp = g_environ_setenv (envp, "CISCO_SPLIT_INC_0_MASKLEN", "24", TRUE);
+	return envp;
+}
+
+int
+main (int argc, char *argv[])
+{
+	char *helper_argv[] = { TEST_TOP_BUILDDIR "/src/nm-openconnect-service-openconnect-helper", NULL };
+	GDBusNodeInfo *node;
+	HelperRun *run = NULL;
+	gboolean acquired = FALSE;
+	GError *error = NULL;
+	GArray *samples;
+	TestBus *bus;
+	char **envp;
+	gint64 start, elapsed;
+	guint object_id, owner_id;
+	guint i, n;
+	GPid pid;
+	int ret = EXIT_SUCCESS;
+
+	bus = test_bus_start ();
+	if (!bus)
+		return TEST_EXIT_SKIP;
+
+	node = g_dbus_node_info_new_for_xml (plugin_xml, &error);
+	g_assert_no_error (error);
+	object_id = g_dbus_connection_register_object (bus->connection,
+	                                               NM_VPN_DBUS_PLUGIN_PATH,
+	                                               node->interfaces[0],
+	                                               &plugin_vtable,
+	                                               &run,
+	                                               NULL,
+	                                               &error);
+	g_assert_no_error (error);
+
+	owner_id = g_bus_own_name_on_connection (bus->connection,
+	                                         NM_DBUS_SERVICE_OPENCONNECT,
+	                                         G_BUS_NAME_OWNER_FLAGS_NONE,
+	                                         name_acquired_cb,
+	                                         NULL,
+	                                         &acquired,
+	                                         NULL);
+	if (!test_wait_until (&acquired, TEST_TIMEOUT_MS))
+		g_error ("Could not own %s", NM_DBUS_SERVICE_OPENCONNECT);
+
+	envp = helper_environ (bus);
+	samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+	n = test_iterations (20);
+	for (i = 0; i < n; i++) {
+		HelperRun this_run = { 0 };
+
+		run = &this_run;
+		start = g_get_monotonic_time ();
+		if (!g_spawn_async (NULL, helper_argv, envp, G_SPAWN_DO_NOT_REAP_CHILD,
+		                    NULL, NULL, &pid, &error))
+			g_error ("Could not run the helper: %s", error->message);
+		g_child_watch_add (pid, helper_exited_cb, run);
+
+		if (!test_wait_until (&run->exited, TEST_TIMEOUT_MS)) {
+			g_printerr ("run %u of %u: the helper did not exit\n", i + 1, n);
+			kill (pid, SIGKILL);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		elapsed = g_get_monotonic_time () - start;
+
+		if (   !WIFEXITED (run->status) || WEXITSTATUS (run->status)
+		    || run->config != 1 || run->ip4config != 1 || run->failure) {
+			g_printerr ("run %u of %u: status %d, %u SetConfig, %u SetIp4Config, %u SetFailure\n",
+			            i + 1, n, run->status, run->config, run->ip4config, run->failure);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		g_array_append_val (samples, elapsed);
+	}
+	run = NULL;
+
+	test_report_latency ("helper", samples);
+
+	g_array_unref (samples);
+	g_strfreev (envp);
+	g_bus_unown_name (owner_id);
+	g_dbus_connection_unregister_object (bus->connection, object_id);
+	g_dbus_node_info_unref (node);
+	test_bus_stop (bus);
+	return ret;
+}
@@ -0,0 +1,206 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Connects and disconnects through nm-openconnect-service over and over,
+ * the way NetworkManager would, and reports how long each step took.
+ * NM_OPENCONNECT_TEST_ITERATIONS sets the number of rounds. */
+
+#include "nm-default.h"
+
+#include "nm-openconnect-test-utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+	NMVpnServiceState want;
+	gboolean reached;
+	gboolean failed;
+} StateWait;
+
+static void
+plugin_signal_cb (GDBusConnection *connection,
+                  const char *sender_name,
+                  const char *object_path,
+                  const char *interface_name,
+                  const char *signal_name,
+                  GVariant *parameters,
+                  gpointer user_data)
+{
+	StateWait *wait = user_data;
+	guint32 value;
+
+	if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(u)")))
+		return;
+	g_variant_get (parameters, "(u)", &value);
+
+	if (!strcmp (signal_name, "StateChanged")) {
+		if (value == wait->want)
+			wait->reached = TRUE;
+	} else if (!strcmp (signal_name, "Failure")) {
+		g_printerr ("plugin failure %u\n", value);
+		wait->failed = TRUE;
+	}
+}
+
+static GVariant *
+connection_new (void)
+{
+	NMConnection *connection;
+	NMSettingConnection *s_con;
+	NMSettingVpn *s_vpn;
+	GVariant *dict;
+	char *uuid;
+
+	connection = nm_simple_connection_new ();
+
+	uuid = nm_utils_uuid_generate ();
+	s_con = NM_SETTING_CONNECTION (nm_setting_connection_new ());
+	g_object_set (s_con,
+	              NM_SETTING_CONNECTION_ID, "openconnect-test",
+	              NM_SETTING_CONNECTION_UUID, uuid,
+	              NM_SETTING_CONNECTION_TYPE, NM_SETTING_VPN_SETTING_NAME,
+	              NULL);
+	nm_connection_add_setting (connection, NM_SETTING (s_con));
+	g_free (uuid);
+
+	s_vpn = NM_SETTING_VPN (nm_setting_vpn_new ());
+	g_object_set (s_vpn, NM_SETTING_VPN_SERVICE_TYPE, NM_DBUS_SERVICE_OPENCONNECT, NULL);
+	nm_setting_vpn_add_data_item (s_vpn, NM_OPENCONNECT_KEY_GATEWAY, "vpn.example.com");
+	nm_setting_vpn_add_secret (s_vpn, NM_OPENCONNECT_KEY_GATEWAY, "192.0.2.1");
+	nm_setting_vpn_add_secret (s_vpn, NM_OPENCONNECT_KEY_COOKIE, "stub-cookie");
+	nm_connection_add_setting (connection, NM_SETTING (s_vpn));
+
+	dict = nm_connection_to_dbus (connection, NM_CONNECTION_SERIALIZE_ALL);
+	g_object_unref (connection);
+	return g_variant_ref_sink (dict);
+}
+
+static gboolean
+plugin_call (TestBus *bus, const char *method, GVariant *parameters)
+{
+	GError *error = NULL;
+	GVariant *ret;
+
+	ret = g_dbus_connection_call_sync (bus->connection,
+	                                   NM_DBUS_SERVICE_OPENCONNECT,
+	                                   NM_VPN_DBUS_PLUGIN_PATH,
+	                                   NM_VPN_DBUS_PLUGIN_INTERFACE,
+	                                   method,
+	                                   parameters,
+	                                   NULL,
+	                                   G_DBUS_CALL_FLAGS_NONE,
+	                                   TEST_TIMEOUT_MS,
+	                                   NULL,
+	                                   &error);
+	if (!ret) {
+		g_printerr ("%s failed: %s\n", method, error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+	g_variant_unref (ret);
+	return TRUE;
+}
+
+/* Calls @method and waits for the plugin to get to @state */
+static gboolean
+plugin_step (TestBus *bus, StateWait *wait, NMVpnServiceState state,
+             const char *method, GVariant *parameters, GArray *samples)
+{
+	gint64 start, elapsed;
+
+	wait->want = state;
+	wait->reached = FALSE;
+	wait->failed = FALSE;
+
+	start = g_get_monotonic_time ();
+	if (!plugin_call (bus, method, parameters))
+		return FALSE;
+	if (!test_wait_until (&wait->reached, TEST_TIMEOUT_MS) || wait->failed) {
+		g_printerr ("%s: plugin did not get to state %u\n", method, state);
+		return FALSE;
+	}
+	elapsed = g_get_monotonic_time () - start;
+	g_array_append_val (samples, elapsed);
+	return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+	GArray *connect_samples, *disconnect_samples;
+	StateWait wait = { 0 };
+	GVariant *connection;
+	guint signal_id;
+	TestBus *bus;
+	GPid pid;
+	guint i, n;
+	int ret = EXIT_SUCCESS;
+
+	bus = test_bus_start ();
+	if (!bus)
+		return TEST_EXIT_SKIP;
+
+	signal_id = g_dbus_connection_signal_subscribe (bus->connection,
+	                                                NM_DBUS_SERVICE_OPENCONNECT,
+	                                                NM_VPN_DBUS_PLUGIN_INTERFACE,
+	                                                NULL,
+	                                                NM_VPN_DBUS_PLUGIN_PATH,
+	                                                NULL,
+	                                                G_DBUS_SIGNAL_FLAGS_NONE,
+	                                                plugin_signal_cb,
+	                                                &wait,
+	                                                NULL);
+
+	pid = test_service_spawn (bus);
+	if (!test_service_wait_ready (bus))
+		g_error ("nm-openconnect-service did not come up");
+
+	connect_samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+	disconnect_samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+	/* The same connection every round, as NetworkManager reconnects it:
+	 * it has to start again as soon as the plugin reports it stopped,
+	 * while the last openconnect may still be on its way out */
+	connection = connection_new ();
+	n = test_iterations (20);
+	for (i = 0; i < n; i++) {
+		if (   !plugin_step (bus, &wait, NM_VPN_SERVICE_STATE_STARTED,
+		                     "Connect", g_variant_new ("(@a{sa{sv}})", connection),
+		                     connect_samples)
+		    || !plugin_step (bus, &wait, NM_VPN_SERVICE_STATE_STOPPED,
+		                     "Disconnect", NULL,
+		                     disconnect_samples)) {
+			g_printerr ("round %u of %u failed\n", i + 1, n);
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	g_variant_unref (connection);
+
+	test_report_latency ("connect", connect_samples);
+	test_report_latency ("disconnect", disconnect_samples);
+
+	g_array_unref (connect_samples);
+	g_array_unref (disconnect_samples);
+
+	test_service_stop (bus, pid);
+	g_dbus_connection_signal_unsubscribe (bus->connection, signal_id);
+	test_bus_stop (bus);
+	return ret;
+}
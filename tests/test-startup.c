@@ -0,0 +1,68 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Starts nm-openconnect-service over and over and reports how long it
+ * takes from the exec until the service answers on the bus. That is the
+ * time NetworkManager waits on every activation, as it starts a service
+ * for each one. NM_OPENCONNECT_TEST_ITERATIONS sets the number of runs. */
+
+#include "nm-default.h"
+
+#include "nm-openconnect-test-utils.h"
+
+#include <stdlib.h>
+
+int
+main (int argc, char *argv[])
+{
+	GArray *samples;
+	TestBus *bus;
+	gint64 start, elapsed;
+	GPid pid;
+	guint i, n;
+	int ret = EXIT_SUCCESS;
+
+	bus = test_bus_start ();
+	if (!bus)
+		return TEST_EXIT_SKIP;
+
+	samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+	n = test_iterations (20);
+	for (i = 0; i < n; i++) {
+		start = g_get_monotonic_time ();
+		pid = test_service_spawn (bus);
+		if (!test_service_wait_ready (bus)) {
+			g_printerr ("run %u of %u: nm-openconnect-service did not come up\n", i + 1, n);
+			test_service_stop (bus, pid);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		elapsed = g_get_monotonic_time () - start;
+		g_array_append_val (samples, elapsed);
+
+		/* The next run has to take the bus name again */
+		test_service_stop (bus, pid);
+	}
+
+	test_report_latency ("time to ready", samples);
+
+	g_array_unref (samples);
+	test_bus_stop (bus);
+	return ret;
+}
@@ -0,0 +1,233 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*- */
+/* NetworkManager -- Network link manager
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The XML profile reader of the auth dialog.
+ * NM_OPENCONNECT_TEST_ITERATIONS sets the number of benchmark runs. */
+
+#include "nm-default.h"
+
+#include "nm-openconnect-test-utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libxml/parser.h>
+#include <libxml/xmlreader.h>
+
+/* xmlconfig.c malloc()s and free()s each host itself and nothing else,
+ * so counting those calls tells whether a parse left any behind. */
+static int hosts_alive;
+
+static void *
+host_malloc (size_t size)
+{
+	hosts_alive++;
+	return malloc (size);
+}
+
+static void
+host_free (void *ptr)
+{
+	if (ptr)
+		hosts_alive--;
+	free (ptr);
+}
+
+#define malloc host_malloc
+#define free host_free
+#include "xmlconfig.c"
+#undef malloc
+#undef free
+
+/*****************************************************************************/
+
+#define PROFILE_HEAD \
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n" \
+	"<AnyConnectProfile xmlns=\"http://schemas.xmlsoap.org/encoding/\">\n" \
+	"<ClientInitialization><UseStartBeforeLogon>false</UseStartBeforeLogon></ClientInitialization>\n"
+
+#define PROFILE_TAIL \
+	"</AnyConnectProfile>\n"
+
+static vpnhost *
+parse (const char *xml)
+{
+	return parse_xmlconfig (xml, strlen (xml));
+}
+
+static void
+assert_host (const vpnhost *host, const char *name, const char *address, const char *group)
+{
+	g_assert (host);
+	g_assert_cmpstr (host->hostname, ==, name);
+	g_assert_cmpstr (host->hostaddress, ==, address);
+	g_assert_cmpstr (host->usergroup, ==, group);
+}
+
+static void
+test_hosts (void)
+{
+	vpnhost *hosts;
+
+	hosts = parse (PROFILE_HEAD
+	               "<ServerList>\n"
+	               "  <HostEntry>\n"
+	               "    <HostName>Europe</HostName>\n"
+	               "    <HostAddress>eu.example.com</HostAddress>\n"
+	               "    <BackupServerList><HostAddress>backup.example.com</HostAddress></BackupServerList>\n"
+	               "  </HostEntry>\n"
+	               "  <HostEntry>\n"
+	               "    <HostName>Asia</HostName>\n"
+	               "    <HostAddress>asia.example.com</HostAddress>\n"
+	               "    <UserGroup>staff</UserGroup>\n"
+	               "  </HostEntry>\n"
+	               "</ServerList>\n"
+	               PROFILE_TAIL);
+	assert_host (hosts, "Europe", "eu.example.com", NULL);
+	assert_host (hosts->next, "Asia", "asia.example.com", "staff");
+	g_assert (!hosts->next->next);
+	g_assert_cmpint (hosts_alive, ==, 2);
+
+	free_vpnhosts (hosts);
+	g_assert_cmpint (hosts_alive, ==, 0);
+}
+
+static void
+test_empty_list (void)
+{
+	g_assert (!parse (PROFILE_HEAD PROFILE_TAIL));
+	g_assert (!parse (PROFILE_HEAD "<ServerList></ServerList>" PROFILE_TAIL));
+	g_assert (!parse (PROFILE_HEAD "<ServerList/>" PROFILE_TAIL));
+	g_assert (!parse (PROFILE_HEAD "<ServerList><HostEntry/></ServerList>" PROFILE_TAIL));
+	g_assert_cmpint (hosts_alive, ==, 0);
+}
+
+static void
+test_incomplete_entries (void)
+{
+	vpnhost *hosts;
+
+	hosts = parse (PROFILE_HEAD
+	               "<ServerList>"
+	               "<HostEntry><HostAddress>noname.example.com</HostAddress></HostEntry>"
+	               "<HostEntry><HostName>No address</HostName></HostEntry>"
+	               "<HostEntry><HostName>Good</HostName><HostAddress>good.example.com</HostAddress></HostEntry>"
+	               "<HostEntry><UserGroup>nothing</UserGroup></HostEntry>"
+	               "</ServerList>"
+	               PROFILE_TAIL);
+	assert_host (hosts, "Good", "good.example.com", NULL);
+	g_assert (!hosts->next);
+
+	/* The dropped ones are gone already */
+	g_assert_cmpint (hosts_alive, ==, 1);
+	free_vpnhosts (hosts);
+	g_assert_cmpint (hosts_alive, ==, 0);
+}
+
+static void
+test_truncated (void)
+{
+	static const char *const docs[] = {
+		PROFILE_HEAD "<ServerList><HostEntry><HostName>A</HostName><HostAddress>a.example.com</HostAddress></HostEntry>",
+		PROFILE_HEAD "<ServerList><HostEntry><HostName>A</HostName><HostAddress>a.example.com</HostAddress></HostEntry>"
+		             "<HostEntry><HostName>B</HostName><HostAddress>b.exa",
+		PROFILE_HEAD "<ServerList><HostEntry><HostName>A</HostName><HostAddress>a.example.com</HostAddress></HostEntry>"
+		             "<HostEntry><HostNa",
+		PROFILE_HEAD "<ServerList><HostEntry><HostName>A</HostName><HostAddress>a.example.com</HostAddress></HostEnt",
+		"<AnyConnectProf",
+		"",
+	};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (docs); i++) {
+		g_assert (!parse (docs[i]));
+		g_assert_cmpint (hosts_alive, ==, 0);
+	}
+}
+
+#define BENCH_HOSTS 2000
+
+/* A profile of the size some sites push, with a backup list per host */
+static char *
+bench_profile_new (void)
+{
+	GString *xml = g_string_new (PROFILE_HEAD "<ServerList>\n");
+	guint i;
+
+	for (i = 0; i < BENCH_HOSTS; i++) {
+		g_string_append_printf (xml,
+		                        "  <HostEntry>\n"
+		                        "    <HostName>Site %u</HostName>\n"
+		                        "    <HostAddress>vpn%u.example.com</HostAddress>\n"
+		                        "    <UserGroup>group%u</UserGroup>\n"
+		                        "    <BackupServerList><HostAddress>backup%u.example.com</HostAddress></BackupServerList>\n"
+		                        "  </HostEntry>\n",
+		                        i, i, i % 8, i);
+	}
+	g_string_append (xml, "</ServerList>\n" PROFILE_TAIL);
+	return g_string_free (xml, FALSE);
+}
+
+static void
+test_bench_large (void)
+{
+	vpnhost *hosts, *host;
+	GArray *samples;
+	gint64 start, elapsed;
+	char *xml;
+	guint i, n, count;
+
+	xml = bench_profile_new ();
+	samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+	n = test_iterations (20);
+	for (i = 0; i < n; i++) {
+		start = g_get_monotonic_time ();
+		hosts = parse (xml);
+		elapsed = g_get_monotonic_time () - start;
+		g_array_append_val (samples, elapsed);
+
+		for (host = hosts, count = 0; host; host = host->next)
+			count++;
+		g_assert_cmpuint (count, ==, BENCH_HOSTS);
+		free_vpnhosts (hosts);
+		g_assert_cmpint (hosts_alive, ==, 0);
+	}
+
+	test_report_latency ("large profile", samples);
+
+	g_array_unref (samples);
+	g_free (xml);
+}
+
+/*****************************************************************************/
+
+int
+main (int argc, char *argv[])
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/xmlconfig/hosts", test_hosts);
+	g_test_add_func ("/xmlconfig/empty-list", test_empty_list);
+	g_test_add_func ("/xmlconfig/incomplete-entries", test_incomplete_entries);
+	g_test_add_func ("/xmlconfig/truncated", test_truncated);
+	g_test_add_func ("/xmlconfig/bench-large", test_bench_large);
+
+	return g_test_run ();
+}